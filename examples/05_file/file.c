@@ -15,7 +15,7 @@ int main(int argc, char **argv)
         fseek(f, 0, SEEK_END);
         size = ftell(f);
         fseek(f, 0, SEEK_SET);
-        printf("File size: %d bytes\n", size);
+        printf("File size: %ld bytes\n", size);
         buff = malloc(size + 1);
         if(!buff) {
             fprintf(stderr, "unable to allocate memory\n");
@@ -1,3 +1,5 @@
+/* %D is a non-standard conversion */
+#define UEFI_NO_FORMAT_CHECK
 #include <uefi.h>
 
 /**
@@ -40,7 +40,7 @@ int main(int argc, char **argv)
         for(i = 0; i < gop->Mode->MaxMode; i++) {
             status = gop->QueryMode(gop, i, &isiz, &info);
             if(EFI_ERROR(status) || info->PixelFormat > PixelBitMask) continue;
-            printf(" %c%3d. %4d x%4d (pitch %4d fmt %d r:%06x g:%06x b:%06x)\n",
+            printf(" %c%3ld. %4d x%4d (pitch %4d fmt %d r:%06x g:%06x b:%06x)\n",
                 i == currentMode ? '*' : ' ', i,
                 info->HorizontalResolution, info->VerticalResolution, info->PixelsPerScanLine, info->PixelFormat,
                 info->PixelFormat==PixelRedGreenBlueReserved8BitPerColor?0xff:(
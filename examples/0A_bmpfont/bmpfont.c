@@ -71,22 +71,26 @@ int main(int argc, char **argv)
     efi_gop_t *gop = NULL;
     FILE *f;
     long int size;
+    int loaded = 0;
 
-    /* load font */
-    if((f = fopen("\\0A_bmpfont\\font.sfn", "r"))) {
-        fseek(f, 0, SEEK_END);
-        size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        font = (ssfn_font_t*)malloc(size + 1);
-        if(!font) {
-            fprintf(stderr, "unable to allocate memory\n");
-            return 1;
+    /* load font, embedded into the image from res/ (see RESDIR in the Makefile), or from disk if that's not supported */
+    if(!(font = (ssfn_font_t*)resource_get("font.sfn", NULL))) {
+        if((f = fopen("\\0A_bmpfont\\font.sfn", "r"))) {
+            fseek(f, 0, SEEK_END);
+            size = ftell(f);
+            fseek(f, 0, SEEK_SET);
+            font = (ssfn_font_t*)malloc(size + 1);
+            if(!font) {
+                fprintf(stderr, "unable to allocate memory\n");
+                return 1;
+            }
+            fread(font, size, 1, f);
+            fclose(f);
+            loaded = 1;
+        } else {
+            fprintf(stderr, "Unable to load font\n");
+            return 0;
         }
-        fread(font, size, 1, f);
-        fclose(f);
-    } else {
-        fprintf(stderr, "Unable to load font\n");
-        return 0;
     }
 
     /* set video mode */
@@ -113,6 +117,6 @@ int main(int argc, char **argv)
     printString(10, 10, "Hello 多种语言 Многоязычный többnyelvű World!");
 
     /* free resources exit */
-    free(font);
+    if(loaded) free(font);
     return 0;
 }
@@ -17,11 +17,15 @@ int main(int argc, char **argv)
     uint32_t *data;
     int w, h, l;
     long int size;
+    size_t rsize;
+    int loaded = 0;
     stbi__context s;
     stbi__result_info ri;
 
-    /* load image */
-    if((f = fopen("\\0C_png\\image.png", "r"))) {
+    /* load image, embedded into the .efi from res/ (see RESDIR in the Makefile), or from disk if that's not supported */
+    if((buff = (unsigned char*)resource_get("image.png", &rsize)))
+        size = (long int)rsize;
+    else if((f = fopen("\\0C_png\\image.png", "r"))) {
         fseek(f, 0, SEEK_END);
         size = ftell(f);
         fseek(f, 0, SEEK_SET);
@@ -32,6 +36,9 @@ int main(int argc, char **argv)
         }
         fread(buff, size, 1, f);
         fclose(f);
+        loaded = 1;
+    }
+    if(buff) {
         ri.bits_per_channel = 8;
         s.read_from_callbacks = 0;
         s.img_buffer = s.img_buffer_original = buff;
@@ -73,6 +80,6 @@ int main(int argc, char **argv)
 
     /* free resources exit */
     free(data);
-    free(buff);
+    if(loaded) free(buff);
     return 0;
 }
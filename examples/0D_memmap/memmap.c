@@ -46,7 +46,7 @@ err:    fprintf(stderr, "Unable to get memory map\n");
     printf("Address              Size Type\n");
     for(mement = memory_map; (uint8_t*)mement < (uint8_t*)memory_map + memory_map_size;
         mement = NextMemoryDescriptor(mement, desc_size)) {
-            printf("%016x %8d %02x %s\n", mement->PhysicalStart, mement->NumberOfPages, mement->Type, types[mement->Type]);
+            printf("%016" PRIx64 " %8" PRIu64 " %02x %s\n", mement->PhysicalStart, mement->NumberOfPages, mement->Type, types[mement->Type]);
     }
 
     free(memory_map);
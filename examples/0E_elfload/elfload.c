@@ -91,7 +91,7 @@ int main(int argc, char **argv)
                 i < elf->e_phnum;
                 i++, phdr = (Elf64_Phdr *)((uint8_t *)phdr + elf->e_phentsize)) {
                     if(phdr->p_type == PT_LOAD) {
-                        printf("ELF segment %p %d bytes (bss %d bytes)\n", phdr->p_vaddr, phdr->p_filesz,
+                        printf("ELF segment %p %" PRIu64 " bytes (bss %" PRIu64 " bytes)\n", (void*)phdr->p_vaddr, phdr->p_filesz,
                             phdr->p_memsz - phdr->p_filesz);
                         memcpy((void*)phdr->p_vaddr, buff + phdr->p_offset, phdr->p_filesz);
                         memset((void*)(phdr->p_vaddr + phdr->p_filesz), 0, phdr->p_memsz - phdr->p_filesz);
@@ -106,7 +106,7 @@ int main(int argc, char **argv)
     free(buff);
 
     /* execute the "kernel" */
-    printf("ELF entry point %p\n", entry);
+    printf("ELF entry point %p\n", (void*)entry);
     i = (*((int(* __attribute__((sysv_abi)))(void))(entry)))();
     printf("ELF returned %d\n", i);
 
@@ -0,0 +1,168 @@
+#include <uefi.h>
+
+#define ROUNDS 8
+
+/**
+ * Read the CPU's cycle counter
+ */
+static uint64_t ticks(void)
+{
+    uint64_t t = 0;
+#ifdef __x86_64__
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    t = ((uint64_t)hi << 32) | lo;
+#endif
+#ifdef __aarch64__
+    __asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r"(t));
+#endif
+    return t;
+}
+
+/**
+ * Print elapsed time and throughput
+ */
+static void report(const char *what, uint64_t t, uint64_t tps, long int size)
+{
+    if(!t) t = 1;
+    printf("%-28s %8ld us %6ld MiB/s\n", what, (long int)(t * 1000000 / tps),
+        (long int)((uint64_t)size * tps / t / 1048576));
+}
+
+/**
+ * Load a whole file into memory, the same way as 0E_elfload does ("rb" keeps compressed files as-is)
+ */
+static char *load(const char *name, const char *mode, long int *size)
+{
+    FILE *f;
+    char *buff;
+
+    if(!(f = fopen(name, mode))) return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buff = malloc(*size + 1);
+    if(buff) fread(buff, *size, 1, f);
+    fclose(f);
+    return buff;
+}
+
+/**
+ * Read a decompressing stream into a buffer of known size
+ */
+static long int stream(const char *name, const char *mode, char *buff, long int size)
+{
+    FILE *f;
+    long int ret;
+
+    if(!(f = fopen(name, mode))) return -1;
+    ret = fread(buff, 1, size + 1, f);
+    fclose(f);
+    return ret;
+}
+
+/**
+ * Compare loading a raw ELF with loading an LZ4 or gzip compressed one
+ */
+int main(int argc, char **argv)
+{
+    char raw[256], lz4[256], gz[256];
+    char *orig, *comp, *buff;
+    long int size, csize, csize2;
+    uint64_t t, tps, best;
+    int i;
+
+    strncpy(raw, argc > 1 ? argv[1] : "\\10_lz4bench\\kernel.elf", sizeof(raw) - 5);
+    raw[sizeof(raw) - 5] = 0;
+    sprintf(lz4, "%s.lz4", raw);
+    sprintf(gz, "%s.gz", raw);
+
+    /* calibrate the cycle counter */
+    t = ticks();
+    BS->Stall(10000);
+    tps = (ticks() - t) * 100;
+    if(!tps) {
+        fprintf(stderr, "no cycle counter\n");
+        return 1;
+    }
+
+    /* the reference: fopen, ftell, malloc, fread */
+    for(i = 0, best = (uint64_t)-1; i < ROUNDS; i++) {
+        t = ticks();
+        orig = load(raw, "r", &size);
+        t = ticks() - t;
+        if(!orig) {
+            fprintf(stderr, "unable to load %s\n", raw);
+            return 1;
+        }
+        if(t < best) best = t;
+        if(i < ROUNDS - 1) free(orig);
+    }
+    printf("%s, %ld bytes, best of %d\n", raw, size, ROUNDS);
+    report("raw fread", best, tps, size);
+    if(!(buff = malloc(size + 1))) {
+        fprintf(stderr, "unable to allocate memory\n");
+        return 1;
+    }
+
+    /* whole compressed file, then one lz4_decompress call */
+    if((comp = load(lz4, "rb", &csize))) {
+        printf("%s, %ld bytes\n", lz4, csize);
+        for(i = 0, best = (uint64_t)-1; i < ROUNDS; i++) {
+            memset(buff, 0, size);
+            t = ticks();
+            csize2 = lz4_decompress(comp, csize, buff, size);
+            t = ticks() - t;
+            if(csize2 != size || memcmp(buff, orig, size)) {
+                fprintf(stderr, "lz4_decompress failed\n");
+                break;
+            }
+            if(t < best) best = t;
+        }
+        if(i == ROUNDS) report("lz4_decompress", best, tps, size);
+        free(comp);
+        for(i = 0, best = (uint64_t)-1; i < ROUNDS; i++) {
+            t = ticks();
+            comp = load(lz4, "rb", &csize);
+            if(!comp) break;
+            csize2 = lz4_decompress(comp, csize, buff, size);
+            free(comp);
+            t = ticks() - t;
+            if(csize2 != size) break;
+            if(t < best) best = t;
+        }
+        if(i == ROUNDS) report("fread + lz4_decompress", best, tps, size);
+
+        /* streaming, fopen detects the frame */
+        for(i = 0, best = (uint64_t)-1; i < ROUNDS; i++) {
+            memset(buff, 0, size);
+            t = ticks();
+            csize2 = stream(lz4, "r", buff, size);
+            t = ticks() - t;
+            if(csize2 != size || memcmp(buff, orig, size)) {
+                if(csize2 != -1) fprintf(stderr, "lz4 stream failed\n");
+                break;
+            }
+            if(t < best) best = t;
+        }
+        if(i == ROUNDS) report("lz4 stream fread", best, tps, size);
+    }
+
+    /* the same with gzip for comparison */
+    for(i = 0, best = (uint64_t)-1; i < ROUNDS; i++) {
+        memset(buff, 0, size);
+        t = ticks();
+        csize2 = stream(gz, "r", buff, size);
+        t = ticks() - t;
+        if(csize2 != size || memcmp(buff, orig, size)) {
+            if(csize2 != -1) fprintf(stderr, "gzip stream failed\n");
+            break;
+        }
+        if(t < best) best = t;
+    }
+    if(i == ROUNDS) report("gzip stream fread", best, tps, size);
+
+    free(buff);
+    free(orig);
+    return 0;
+}
@@ -0,0 +1,504 @@
+/*
+ * archive.c
+ *
+ * Copyright (C) 2021 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the POSIX-UEFI package.
+ * @brief Implementing read-only tar and cpio archives mounted under a path prefix
+ *
+ */
+
+#include <uefi.h>
+
+
+/* The whole archive is read into one buffer when it's mounted, and its members are opened as read-only memory streams
+ * pointing into that buffer, so the data is only copied by fread. Names are kept as UTF-8, as stored in the archive
+ * (without the leading "./" and the trailing "/" of directories), and looked up through an open addressing hash. */
+
+/* first read buffer if the archive's size isn't known in advance (streams decompressed by fopen) */
+#ifndef __ARCBUFSIZ
+#define __ARCBUFSIZ (1024*1024)
+#endif
+/* longest name below a mount point that can be looked up, in UTF-8 bytes */
+#ifndef __ARCKEY
+#define __ARCKEY    1024
+#endif
+
+typedef struct {
+    uint8_t *data;                  /* points into the image, the header for directories */
+    uint64_t size;
+    time_t mtime;
+    mode_t mode;                    /* S_IFREG or S_IFDIR */
+    uint32_t name, len;             /* offset in the name pool and length */
+    uint32_t hash;
+} __arcent_t;
+
+typedef struct __arc_s {
+    struct __arc_s *next;
+    char_t *prefix;                 /* mount point, without trailing separators */
+    size_t plen;
+    uint8_t *image;
+    size_t size;
+    __arcent_t root;                /* the mount point itself */
+    __arcent_t *ent;
+    uint32_t nent, maxent;
+    uint32_t *hash;                 /* entry index + 1, zero for free slots */
+    uint32_t hmask;
+    char *names;
+    size_t nlen, nmax;
+} __arc_t;
+
+static __arc_t *__arc_mounts = NULL;
+
+/* FNV-1a */
+static uint32_t __arc_hash (const char *s, size_t n)
+{
+    uint32_t h = 2166136261U;
+    while(n--) h = (h ^ (uint8_t)*s++) * 16777619U;
+    return h;
+}
+
+/* length of a fixed size field that may or may not be zero terminated */
+static size_t __arc_len (const uint8_t *p, size_t n)
+{
+    size_t l;
+    for(l = 0; l < n && p[l]; l++);
+    return l;
+}
+
+/* ASCII number in a header field, octal for tar and odc cpio, hexadecimal for newc cpio */
+static uint64_t __arc_num (const uint8_t *p, size_t n, int base)
+{
+    uint64_t r = 0;
+    int d;
+    for(; n && *p == ' '; p++, n--);
+    for(; n; p++, n--) {
+        if(*p >= '0' && *p <= '9') d = *p - '0'; else
+        if(base == 16 && (*p | 32) >= 'a' && (*p | 32) <= 'f') d = (*p | 32) - 'a' + 10;
+        else break;
+        if(d >= base) break;
+        r = r * (uint64_t)base + (uint64_t)d;
+    }
+    return r;
+}
+
+/* strip the "/" and "./" in front and the "/" after names, "." is the archive's root */
+static void __arc_norm (const char **name, size_t *len)
+{
+    const char *s = *name;
+    size_t n = *len;
+    while(n) {
+        if(*s == '/') { s++; n--; } else
+        if(n >= 2 && s[0] == '.' && s[1] == '/') { s += 2; n -= 2; }
+        else break;
+    }
+    if(n == 1 && *s == '.') n = 0;
+    while(n && s[n - 1] == '/') n--;
+    *name = s;
+    *len = n;
+}
+
+static __arcent_t *__arc_lookup (__arc_t *a, const char *name, size_t len)
+{
+    uint32_t h = __arc_hash(name, len), i, k;
+    __arcent_t *e;
+    if(!a->hash) return NULL;
+    for(i = h & a->hmask; (k = a->hash[i]); i = (i + 1) & a->hmask) {
+        e = &a->ent[k - 1];
+        if(e->hash == h && e->len == len && !memcmp(a->names + e->name, name, len)) return e;
+    }
+    return NULL;
+}
+
+/**
+ * Add a member to the index. Later members replace earlier ones with the same name, like when the archive is extracted
+ */
+static int __arc_add (__arc_t *a, const char *name, size_t len, uint8_t *data, uint64_t size, mode_t mode, time_t mtime)
+{
+    __arcent_t *e;
+    uint32_t *hash, i, k, h;
+    void *p;
+    size_t n;
+
+    __arc_norm(&name, &len);
+    if(!len) return 0;
+    if(!(e = __arc_lookup(a, name, len))) {
+        if(a->nent == a->maxent) {
+            n = a->maxent ? 2 * a->maxent : 64;
+            if(!(p = realloc(a->ent, n * sizeof(__arcent_t)))) return -1;
+            a->ent = (__arcent_t*)p;
+            a->maxent = (uint32_t)n;
+        }
+        if(a->nlen + len + 1 > a->nmax) {
+            n = 2 * (a->nmax + len + 1);
+            if(!(p = realloc(a->names, n))) return -1;
+            a->names = (char*)p;
+            a->nmax = n;
+        }
+        /* keep the hash table at most half full */
+        if(2 * (a->nent + 1) > a->hmask + 1 || !a->hash) {
+            n = a->hash ? 2 * ((size_t)a->hmask + 1) : 128;
+            if(!(hash = (uint32_t*)calloc(n, sizeof(uint32_t)))) return -1;
+            for(k = 0; k < a->nent; k++) {
+                for(i = a->ent[k].hash & (uint32_t)(n - 1); hash[i]; i = (i + 1) & (uint32_t)(n - 1));
+                hash[i] = k + 1;
+            }
+            free(a->hash);
+            a->hash = hash;
+            a->hmask = (uint32_t)(n - 1);
+        }
+        h = __arc_hash(name, len);
+        e = &a->ent[a->nent++];
+        e->name = (uint32_t)a->nlen;
+        e->len = (uint32_t)len;
+        e->hash = h;
+        memcpy(a->names + a->nlen, name, len);
+        a->names[a->nlen + len] = 0;
+        a->nlen += len + 1;
+        for(i = h & a->hmask; a->hash[i]; i = (i + 1) & a->hmask);
+        a->hash[i] = a->nent;
+    }
+    e->data = data;
+    e->size = size;
+    e->mode = mode;
+    e->mtime = mtime;
+    return 0;
+}
+
+static int __arc_tarsum (const uint8_t *p)
+{
+    uint64_t s = 0;
+    int i;
+    for(i = 0; i < 512; i++)
+        s += i >= 148 && i < 156 ? ' ' : p[i];
+    return s == __arc_num(p + 148, 8, 8);
+}
+
+/**
+ * Index a ustar, GNU or pax tar archive. Regular files, directories and hard links are kept, everything else is skipped
+ */
+static int __arc_tar (__arc_t *a)
+{
+    uint8_t *p, *data, *end = a->image + a->size, *lname = NULL;
+    char tmp[257];
+    const char *name, *link;
+    uint64_t size;
+    size_t len, llen = 0, k, l;
+    __arcent_t *e;
+    int i, r = 0;
+
+    for(p = a->image; p + 512 <= end && *p && !r; p = data + ((size + 511) & ~511ULL)) {
+        if(!__arc_tarsum(p)) break;
+        data = p + 512;
+        if(p[124] & 0x80) {
+            /* GNU base-256 for sizes over 8G */
+            for(size = 0, i = 4; i < 12; i++) size = (size << 8) | p[124 + i];
+        } else
+            size = __arc_num(p + 124, 12, 8);
+        if(size > (uint64_t)(end - data)) break;
+        switch(p[156]) {
+            /* GNU long name for the next member */
+            case 'L': lname = data; llen = __arc_len(data, size); continue;
+            /* pax extended header, only the path is used from it */
+            case 'x':
+                for(k = 0; k < size; k += l) {
+                    l = (size_t)__arc_num(data + k, size - k, 10);
+                    if(!l || l > size - k) break;
+                    for(i = 0; k + i < size && data[k + i] != ' '; i++);
+                    if(l > (size_t)i + 7 && !memcmp(data + k + i + 1, "path=", 5)) {
+                        lname = data + k + i + 6;
+                        llen = l - i - 7;
+                    }
+                }
+                continue;
+            case 'g': continue;
+            default: break;
+        }
+        if(lname) {
+            name = (const char*)lname;
+            len = llen;
+        } else {
+            name = (const char*)p;
+            len = __arc_len(p, 100);
+            /* POSIX ustar splits long names, GNU keeps other fields there */
+            if(!memcmp(p + 257, "ustar", 6) && p[345]) {
+                k = __arc_len(p + 345, 155);
+                memcpy(tmp, p + 345, k);
+                tmp[k] = '/';
+                memcpy(tmp + k + 1, p, len);
+                name = tmp;
+                len += k + 1;
+            }
+        }
+        lname = NULL;
+        switch(p[156]) {
+            case 0: case '0': case '7':
+                r = __arc_add(a, name, len, data, size, S_IFREG, (time_t)__arc_num(p + 136, 12, 8));
+            break;
+            case '5':
+                r = __arc_add(a, name, len, p, 0, S_IFDIR, (time_t)__arc_num(p + 136, 12, 8));
+            break;
+            case '1':
+                /* hard links refer to an earlier member */
+                link = (const char*)p + 157;
+                l = __arc_len(p + 157, 100);
+                __arc_norm(&link, &l);
+                if((e = __arc_lookup(a, link, l)) && e->mode == S_IFREG)
+                    r = __arc_add(a, name, len, e->data, e->size, S_IFREG, e->mtime);
+            break;
+            default: break;
+        }
+    }
+    return r;
+}
+
+/**
+ * Index a newc ("070701", "070702") or odc ("070707") cpio archive, regular files and directories only
+ */
+static int __arc_cpio (__arc_t *a)
+{
+    uint8_t *p = a->image, *name, *data, *next, *q, *ldata, *end = a->image + a->size;
+    uint64_t size, nsz, mode, mtime, k, l;
+    int newc, r = 0;
+
+    while(!r && p + 76 <= end && !memcmp(p, "07070", 5)) {
+        if((newc = p[5] != '7')) {
+            if(p + 110 > end) break;
+            mode = __arc_num(p + 14, 8, 16);
+            mtime = __arc_num(p + 46, 8, 16);
+            size = __arc_num(p + 54, 8, 16);
+            nsz = __arc_num(p + 94, 8, 16);
+            name = p + 110;
+        } else {
+            mode = __arc_num(p + 18, 6, 8);
+            mtime = __arc_num(p + 48, 11, 8);
+            nsz = __arc_num(p + 59, 6, 8);
+            size = __arc_num(p + 65, 11, 8);
+            name = p + 76;
+        }
+        if(nsz > (uint64_t)(end - name)) break;
+        /* newc pads the header with the name and the data to multiples of 4 */
+        data = newc ? a->image + ((name + nsz - a->image + 3) & ~3) : name + nsz;
+        if(data > end || size > (uint64_t)(end - data)) break;
+        nsz = __arc_len(name, nsz);
+        if(nsz == 10 && !memcmp(name, "TRAILER!!!", 10)) break;
+        next = newc ? a->image + ((data + size - a->image + 3) & ~3) : data + size;
+        /* newc stores the data of hard links only once, with the last link of the same inode */
+        if(newc && !size && __arc_num(p + 38, 8, 16) > 1 && (mode & S_IFMT) == S_IFREG)
+            for(q = next; q + 110 <= end && !memcmp(q, "07070", 5) && q[5] != '7'; ) {
+                k = __arc_num(q + 94, 8, 16);
+                l = __arc_num(q + 54, 8, 16);
+                ldata = a->image + ((q + 110 + k - a->image + 3) & ~3);
+                if(k > (uint64_t)(end - q) || ldata > end || l > (uint64_t)(end - ldata)) break;
+                if(l && !memcmp(q + 6, p + 6, 8) && !memcmp(q + 62, p + 62, 16)) {
+                    data = ldata;
+                    size = l;
+                    break;
+                }
+                q = a->image + ((ldata + l - a->image + 3) & ~3);
+            }
+        if((mode & S_IFMT) == S_IFREG)
+            r = __arc_add(a, (const char*)name, nsz, data, size, S_IFREG, (time_t)mtime);
+        else if((mode & S_IFMT) == S_IFDIR)
+            r = __arc_add(a, (const char*)name, nsz, p, 0, S_IFDIR, (time_t)mtime);
+        p = next;
+    }
+    return r;
+}
+
+/* number of prefix characters, without trailing separators */
+static size_t __arc_plen (const char_t *__prefix)
+{
+    size_t l;
+    for(l = 0; __prefix[l]; l++);
+    while(l && (__prefix[l - 1] == CL('/') || __prefix[l - 1] == CL('\\'))) l--;
+    return l;
+}
+
+/* does path start with the mount point? separators match either way */
+static int __arc_match (__arc_t *a, const char_t *__path)
+{
+    size_t i;
+    for(i = 0; i < a->plen; i++)
+        if(__path[i] != a->prefix[i] && !((__path[i] == CL('/') || __path[i] == CL('\\')) &&
+          (a->prefix[i] == CL('/') || a->prefix[i] == CL('\\'))))
+            return 0;
+    return !__path[i] || __path[i] == CL('/') || __path[i] == CL('\\');
+}
+
+static void __arc_free (__arc_t *a)
+{
+    free(a->prefix);
+    free(a->image);
+    free(a->ent);
+    free(a->hash);
+    free(a->names);
+    free(a);
+}
+
+int archive_mount (const char_t *__archive, const char_t *__prefix)
+{
+    __arc_t *a;
+    FILE *f;
+    struct stat st;
+    size_t n, cap, plen;
+    void *p;
+
+    if(!__archive || !*__archive || !__prefix || !(plen = __arc_plen(__prefix))) {
+        errno = EINVAL;
+        return -1;
+    }
+    for(a = __arc_mounts; a; a = a->next)
+        if(a->plen == plen && __arc_match(a, __prefix)) {
+            errno = EBUSY;
+            return -1;
+        }
+    if(!(a = (__arc_t*)calloc(1, sizeof(__arc_t)))) return -1;
+    if(!(a->prefix = (char_t*)malloc((plen + 1) * sizeof(char_t)))) goto err;
+    memcpy(a->prefix, __prefix, plen * sizeof(char_t));
+    a->prefix[plen] = 0;
+    a->plen = plen;
+    /* read it at once, "r" also decompresses .gz and .lz4 archives */
+    if(!(f = fopen(__archive, CL("r")))) goto err;
+    cap = !fstat(f, &st) && st.st_size > 0 ? (size_t)st.st_size + 1 : __ARCBUFSIZ;
+    errno = 0;
+    for(n = 0;; cap *= 2) {
+        if(!(p = realloc(a->image, cap))) { fclose(f); goto err; }
+        a->image = (uint8_t*)p;
+        n += fread(a->image + n, 1, cap - n, f);
+        if(n < cap) break;
+    }
+    fclose(f);
+    if(errno == EIO) goto err;
+    a->size = n;
+    if(n >= 6 && !memcmp(a->image, "07070", 5) && (a->image[5] == '1' || a->image[5] == '2' || a->image[5] == '7')) {
+        if(__arc_cpio(a)) goto err;
+    } else
+    if(n >= 512 && __arc_tarsum(a->image)) {
+        if(__arc_tar(a)) goto err;
+    } else {
+        errno = EINVAL;
+        goto err;
+    }
+    a->root.data = a->image;
+    a->root.mode = S_IFDIR;
+    a->next = __arc_mounts;
+    __arc_mounts = a;
+    return 0;
+err:
+    __arc_free(a);
+    return -1;
+}
+
+int archive_umount (const char_t *__prefix)
+{
+    __arc_t *a, **prev;
+    FILE *f;
+    size_t plen;
+
+    if(!__prefix) {
+        errno = EINVAL;
+        return -1;
+    }
+    plen = __arc_plen(__prefix);
+    for(prev = &__arc_mounts; (a = *prev) && !(a->plen == plen && __arc_match(a, __prefix)); prev = &a->next);
+    if(!a) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* open members point into the image */
+    for(f = &__stdio_files[3]; f < &__stdio_files[FOPEN_MAX]; f++)
+        if(f->type == __FT_MEM && f->h.mem >= a->image && f->h.mem <= a->image + a->size) {
+            errno = EBUSY;
+            return -1;
+        }
+    *prev = a->next;
+    __arc_free(a);
+    return 0;
+}
+
+/**
+ * Look up a path in the mounted archives. Returns -1 if it's not below any mount point, 0 (errno set) if it is, but
+ * there's no such member, and 1 if the member was found
+ */
+int __archive_find (const char_t *__path, void **__ent)
+{
+    __arc_t *a;
+    const char_t *s;
+    char key[__ARCKEY];
+    size_t n = 0;
+
+    for(a = __arc_mounts; a && !__arc_match(a, __path); a = a->next);
+    if(!a) return -1;
+    /* the rest of the path as a normalized UTF-8 key, "." and ".." resolved */
+    for(__path += a->plen;;) {
+        while(*__path == CL('/') || *__path == CL('\\')) __path++;
+        if(!*__path) break;
+        for(s = __path; *s && *s != CL('/') && *s != CL('\\'); s++);
+        if(s - __path == 1 && __path[0] == CL('.')) { __path = s; continue; }
+        if(s - __path == 2 && __path[0] == CL('.') && __path[1] == CL('.')) {
+            while(n && key[--n] != '/');
+            __path = s;
+            continue;
+        }
+        if(n) key[n++] = '/';
+        for(; __path < s; __path++) {
+            if(n + 4 > sizeof(key)) {
+                errno = ENAMETOOLONG;
+                return 0;
+            }
+#if USE_UTF8
+            key[n++] = *__path;
+#else
+            n += wctomb(key + n, *__path);
+#endif
+        }
+    }
+    if(!(*__ent = n ? (void*)__arc_lookup(a, key, n) : (void*)&a->root)) {
+        errno = ENOENT;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Fill in stat for a member and return its data
+ */
+uint8_t *__archive_entry (void *__ent, struct stat *__buf)
+{
+    __arcent_t *e = (__arcent_t*)__ent;
+    __buf->st_mode = S_IREAD | e->mode;
+    __buf->st_size = (off_t)e->size;
+    __buf->st_blocks = (blkcnt_t)((e->size + 511) & ~511ULL);
+    __buf->st_atime = __buf->st_mtime = __buf->st_ctime = e->mtime;
+    return e->data;
+}
+
+void __archive_cleanup (void)
+{
+    __arc_t *a;
+    while((a = __arc_mounts)) {
+        __arc_mounts = a->next;
+        __arc_free(a);
+    }
+}
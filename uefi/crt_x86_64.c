@@ -150,10 +150,10 @@ int uefi_init (
     efi_shell_interface_protocol_t *shi = NULL;
     efi_guid_t lipGuid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
     efi_status_t status;
-    int argc = 0, i;
+    int argc = 0, i, ret;
     wchar_t **argv = NULL;
 #if USE_UTF8
-    int ret, j;
+    int j;
     char *s;
 #endif
 #ifndef __clang__
@@ -172,7 +172,7 @@ int uefi_init (
     if (rel && relent) {
         while (relsz > 0) {
             if(ELF64_R_TYPE (rel->r_info) == R_X86_64_RELATIVE)
-                { addr = (unsigned long *)(ldbase + rel->r_offset); *addr += ldbase; break; }
+                { addr = (unsigned long *)(ldbase + rel->r_offset); *addr += ldbase; }
             rel = (Elf64_Rel*) ((char *) rel + relent);
             relsz -= relent;
         }
@@ -228,8 +228,11 @@ int uefi_init (
     }
     ret = main(argc, (char**)__argvutf8);
     if(__argvutf8) BS->FreePool(__argvutf8);
-    return ret;
 #else
-    return main(argc, argv);
+    ret = main(argc, argv);
 #endif
+    /* write out anything left in the console buffers */
+    fflush(stdout);
+    fflush(stderr);
+    return ret;
 }
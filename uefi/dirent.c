@@ -30,47 +30,386 @@
 
 #include <uefi.h>
 
+/* directory records are read ahead into a per-DIR buffer of this many bytes */
+#ifndef __DIRBUFSIZ
+#define __DIRBUFSIZ 16384
+#endif
+/* nftw's limits, it allocates the path buffer and one record per level once */
+#ifndef __FTW_DEPTH
+#define __FTW_DEPTH 64
+#endif
+#ifndef __FTW_PATH
+#define __FTW_PATH 1024
+#endif
+
 extern void __stdio_seterrno(efi_status_t status);
-struct dirent __dirent;
+extern void __stat_info(efi_file_info_t *info, struct stat *__buf);
+extern wchar_t *__stdio_wpath(const char_t *__path);
 
-DIR *opendir (const char_t *__name)
+/* the DIR buffer starts with this header, followed by the raw efi_file_info_t records.
+ * The stream's bufsiz is the size of the record area, buflen is how much of it is
+ * filled, and offset is the telldir position of the next entry. */
+typedef struct {
+    struct dirent ent;      /* returned by readdir */
+    long base;              /* position of the first buffered record */
+    size_t pos;             /* read cursor in the record area */
+    int eod;                /* the firmware has no more entries */
+} __dir_t;
+#define __DIRHDR ((sizeof(__dir_t) + 7) & ~7)
+#define __DIRREC(d) ((uint8_t*)(d)->buf + __DIRHDR)
+
+static __dir_t *__dir_hdr (DIR *__dirp)
 {
-    DIR *dp = (DIR*)fopen(__name, CL("rd"));
-    if(dp) rewinddir(dp);
-    return dp;
+    if(!__dirp->buf) {
+        if(!(__dirp->buf = malloc(__DIRHDR + __DIRBUFSIZ))) return NULL;
+        memset(__dirp->buf, 0, __DIRHDR);
+        ((__dir_t*)__dirp->buf)->base = __dirp->offset;
+        __dirp->flags |= __FF_FREEBUF;
+        __dirp->bufsiz = __DIRBUFSIZ;
+        __dirp->buflen = 0;
+    }
+    return (__dir_t*)__dirp->buf;
 }
 
-struct dirent *readdir (DIR *__dirp)
+/* UEFI returns one entry per Read, so keep reading until the buffer can't hold a maximum
+ * sized record. readdir works out of memory until the buffer is drained, which saves the
+ * per-entry copy and transcoding, not the firmware calls. */
+static void __dir_fill (DIR *__dirp, __dir_t *hdr)
 {
     efi_status_t status;
-    efi_file_info_t info;
-    uintn_t bs = sizeof(efi_file_info_t);
-    memset(&__dirent, 0, sizeof(struct dirent));
-    status = __dirp->Read(__dirp, &bs, &info);
-    if(EFI_ERROR(status) || !bs) {
-        if(EFI_ERROR(status)) __stdio_seterrno(status);
-        else errno = 0;
+    uintn_t bs;
+    uint8_t *rec = __DIRREC(__dirp);
+    hdr->base = __dirp->offset;
+    hdr->pos = __dirp->buflen = 0;
+    while(__dirp->bufsiz - __dirp->buflen >= sizeof(efi_file_info_t)) {
+        bs = __dirp->bufsiz - __dirp->buflen;
+        status = __dirp->h.fh->Read(__dirp->h.fh, &bs, rec + __dirp->buflen);
+        if(status == EFI_BUFFER_TOO_SMALL && __dirp->buflen) break;
+        if(EFI_ERROR(status)) { __stdio_seterrno(status); return; }
+        if(!bs) { hdr->eod = 1; break; }
+        /* don't trust Size, some firmware leave it at the buffer's size */
+        ((efi_file_info_t*)(rec + __dirp->buflen))->Size = bs;
+        __dirp->buflen += (bs + 7) & ~7;
+    }
+}
+
+static efi_file_info_t *__dir_next (DIR *__dirp)
+{
+    __dir_t *hdr;
+    efi_file_info_t *info;
+    if(!__dirp || __dirp->type != __FT_FILE) {
+        errno = EBADF;
         return NULL;
     }
-    __dirent.d_type = info.Attribute & EFI_FILE_DIRECTORY ? DT_DIR : DT_REG;
+    if(!(hdr = __dir_hdr(__dirp))) return NULL;
+    errno = 0;
+    if(hdr->pos >= __dirp->buflen) {
+        if(hdr->eod) return NULL;
+        __dir_fill(__dirp, hdr);
+        if(!__dirp->buflen) return NULL;
+    }
+    info = (efi_file_info_t*)(__DIRREC(__dirp) + hdr->pos);
+    hdr->pos += (info->Size + 7) & ~7;
+    __dirp->offset++;
+    return info;
+}
+
+static void __dir_conv (efi_file_info_t *info, struct dirent *ent)
+{
+    memset(ent, 0, sizeof(struct dirent));
+    ent->d_type = info->Attribute & EFI_FILE_DIRECTORY ? DT_DIR : DT_REG;
 #if USE_UTF8
-    __dirent.d_reclen = wcstombs(__dirent.d_name, info.FileName, FILENAME_MAX - 1);
+    ent->d_reclen = wcstombs(ent->d_name, info->FileName, FILENAME_MAX - 1);
 #else
-    __dirent.d_reclen = strlen(info.FileName);
-    strncpy(__dirent.d_name, info.FileName, FILENAME_MAX - 1);
+    ent->d_reclen = strlen(info->FileName);
+    strncpy(ent->d_name, info->FileName, FILENAME_MAX - 1);
 #endif
-    return &__dirent;
+}
+
+DIR *opendir (const char_t *__name)
+{
+    DIR *dp = (DIR*)fopen(__name, CL("rd"));
+    if(dp && dp->type != __FT_FILE) {
+        fclose(dp);
+        errno = ENOTDIR;
+        return NULL;
+    }
+    if(dp) {
+        rewinddir(dp);
+        if(!__dir_hdr(dp)) {
+            fclose(dp);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    return dp;
+}
+
+struct dirent *readdir (DIR *__dirp)
+{
+    efi_file_info_t *info = __dir_next(__dirp);
+    if(!info) return NULL;
+    __dir_conv(info, &((__dir_t*)__dirp->buf)->ent);
+    return &((__dir_t*)__dirp->buf)->ent;
+}
+
+struct dirent *readdir_plus (DIR *__dirp, struct stat *__buf)
+{
+    efi_file_info_t *info = __dir_next(__dirp);
+    if(!info) return NULL;
+    if(__buf) __stat_info(info, __buf);
+    __dir_conv(info, &((__dir_t*)__dirp->buf)->ent);
+    return &((__dir_t*)__dirp->buf)->ent;
+}
+
+int readdir_r (DIR *__dirp, struct dirent *__entry, struct dirent **__result)
+{
+    efi_file_info_t *info = __dir_next(__dirp);
+    *__result = NULL;
+    if(!info) return errno;
+    __dir_conv(info, __entry);
+    *__result = __entry;
+    return 0;
+}
+
+/* FAT is case insensitive, but only for ASCII in practice */
+static int __dir_namecmp (const wchar_t *a, const wchar_t *b)
+{
+    wchar_t x, y;
+    do {
+        x = *a++; y = *b++;
+        if(x >= L'a' && x <= L'z') x -= 32;
+        if(y >= L'a' && y <= L'z') y -= 32;
+    } while(x && x == y);
+    return x != y;
+}
+
+int fstatat (DIR *__dirp, const char_t *__name, struct stat *__buf, int __flag)
+{
+    wchar_t *wcname, *wc;
+    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
+    efi_file_info_t info, *rec;
+    efi_file_handle_t *fh;
+    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t);
+    efi_status_t status;
+    size_t i;
+    (void)__flag;
+    if(!__dirp) return stat(__name, __buf);
+    if(__dirp->type != __FT_FILE) {
+        errno = EBADF;
+        return -1;
+    }
+    if(!__name || !*__name || !__buf) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(!(wcname = __stdio_wpath(__name))) return -1;
+    for(wc = wcname; *wc && *wc != L'\\'; wc++);
+    /* a plain name that was already read ahead needs no firmware calls at all */
+    if(!*wc && __dirp->buf)
+        for(i = 0; i < __dirp->buflen; i += (rec->Size + 7) & ~7) {
+            rec = (efi_file_info_t*)(__DIRREC(__dirp) + i);
+            if(!__dir_namecmp(rec->FileName, wcname)) {
+                __stat_info(rec, __buf);
+                return 0;
+            }
+        }
+    /* otherwise look it up relative to the directory, so the firmware doesn't walk the full path */
+    status = __dirp->h.fh->Open(__dirp->h.fh, &fh, wcname, EFI_FILE_MODE_READ, 0);
+    if(!EFI_ERROR(status)) {
+        status = fh->GetInfo(fh, &infGuid, &fsiz, &info);
+        fh->Close(fh);
+    }
+    if(EFI_ERROR(status)) {
+        memset(__buf, 0, sizeof(struct stat));
+        __stdio_seterrno(status);
+        return -1;
+    }
+    __stat_info(&info, __buf);
+    return 0;
 }
 
 void rewinddir (DIR *__dirp)
 {
-    if(__dirp)
-        __dirp->SetPosition(__dirp, 0);
+    __dir_t *hdr;
+    if(__dirp && __dirp->type == __FT_FILE) {
+        __dirp->h.fh->SetPosition(__dirp->h.fh, 0);
+        __dirp->offset = 0;
+        __dirp->buflen = 0;
+        if((hdr = (__dir_t*)__dirp->buf)) {
+            hdr->base = 0;
+            hdr->pos = 0;
+            hdr->eod = 0;
+        }
+    }
 }
 
-int closedir (DIR *__dirp)
+long telldir (DIR *__dirp)
 {
-    return fclose((FILE*)__dirp);
+    if(!__dirp || __dirp->type != __FT_FILE) {
+        errno = EBADF;
+        return -1;
+    }
+    return (long)__dirp->offset;
+}
+
+/* directories can only be rewound, so positions before the buffer cost a rewind and a rescan */
+void seekdir (DIR *__dirp, long __pos)
+{
+    __dir_t *hdr;
+    if(!__dirp || __dirp->type != __FT_FILE || __pos < 0) return;
+    hdr = (__dir_t*)__dirp->buf;
+    if(!hdr || __pos < hdr->base) rewinddir(__dirp);
+    else {
+        hdr->pos = 0;
+        __dirp->offset = hdr->base;
+    }
+    while((long)__dirp->offset < __pos && __dir_next(__dirp));
 }
 
+/*** recursive walk ***/
+typedef struct {
+    efi_file_handle_t *fh;
+    struct stat st;
+    int len;                /* length of the directory's path */
+    int base;
+    int skip;               /* FTW_SKIP_SIBLINGS was returned for one of its entries */
+} __ftw_t;
 
+/* returns 1 if the walk must stop, sets *skip for FTW_SKIP_SUBTREE */
+static int __ftw_call (__nftw_func_t fn, const char_t *path, struct stat *st, int type, int base, int level,
+    int flags, int *ret, int *skipsib, int *skipsub)
+{
+    struct FTW ftw;
+    int r;
+    ftw.base = base;
+    ftw.level = level;
+    r = (*fn)(path, st, type, &ftw);
+    if(!r) return 0;
+    if(!(flags & FTW_ACTIONRETVAL) || r == FTW_STOP) { *ret = r; return 1; }
+    if(r == FTW_SKIP_SIBLINGS && skipsib) *skipsib = 1;
+    if(r == FTW_SKIP_SUBTREE && skipsub) *skipsub = 1;
+    return 0;
+}
+
+/**
+ * Walk a directory tree. Subdirectories are opened relative to their parent's handle, which stays open, and stat data
+ * comes from the directory records, so every entry costs one firmware Read and directories one Open more. Memory use
+ * doesn't depend on the tree, but it is limited to __FTW_DEPTH levels (deeper directories are reported as FTW_DNR).
+ * There are no file descriptors, so __nopenfd is unused.
+ */
+int nftw (const char_t *__dir, __nftw_func_t __fn, int __nopenfd, int __flags)
+{
+    FILE *f;
+    __ftw_t *lvl, *lv;
+    efi_file_info_t info;
+    efi_file_handle_t *fh;
+    struct stat st;
+    uintn_t bs;
+    char_t *path, sep;
+    int depth = 0, ret = 0, len, skip, pre = !(__flags & FTW_DEPTH) || (__flags & FTW_PREPOST);
+    int post = __flags & (FTW_DEPTH | FTW_PREPOST);
+    const char_t *s;
+    (void)__nopenfd;
+    if(!__dir || !*__dir || !__fn) {
+        errno = EINVAL;
+        return -1;
+    }
+    for(s = __dir, len = 0; *s; s++)
+        if(*s == CL('/') || *s == CL('\\')) len = s - __dir + 1;
+    sep = strchr(__dir, CL('\\')) ? CL('\\') : CL('/');
+    if(!(f = fopen(__dir, CL("rd")))) {
+        /* not a directory, report only that */
+        if(errno != ENOTDIR || stat(__dir, &st)) return -1;
+        __ftw_call(__fn, __dir, &st, FTW_F, len, 0, __flags, &ret, NULL, NULL);
+        return ret;
+    }
+    if(f->type != __FT_FILE) {
+        fclose(f);
+        errno = ENOTDIR;
+        return -1;
+    }
+    if(!(lvl = (__ftw_t*)malloc(__FTW_DEPTH * sizeof(__ftw_t) + __FTW_PATH * sizeof(char_t)))) {
+        fclose(f);
+        return -1;
+    }
+    path = (char_t*)&lvl[__FTW_DEPTH];
+    lv = &lvl[0];
+    memset(lv, 0, sizeof(__ftw_t));
+    lv->fh = f->h.fh;
+    lv->base = len;
+    lv->len = strlen(__dir);
+    if(lv->len >= __FTW_PATH - 1 || fstat(f, &lv->st)) {
+        if(lv->len >= __FTW_PATH - 1) errno = ENAMETOOLONG;
+        ret = -1; goto end;
+    }
+    memcpy(path, __dir, lv->len * sizeof(char_t));
+    /* don't double the separator after a root directory */
+    if(lv->len && (path[lv->len - 1] == CL('/') || path[lv->len - 1] == CL('\\'))) lv->len--;
+    skip = 0;
+    if(pre && __ftw_call(__fn, __dir, &lv->st, FTW_D, lv->base, 0, __flags, &ret, NULL, &skip)) goto end;
+    if(skip) goto end;
+    while(depth >= 0) {
+        lv = &lvl[depth];
+        bs = sizeof(efi_file_info_t);
+        if(lv->skip || EFI_ERROR(lv->fh->Read(lv->fh, &bs, &info)) || !bs) {
+            /* end of this directory */
+            path[lv->len] = 0;
+            if(post && __ftw_call(__fn, depth ? path : __dir, &lv->st, FTW_DP, lv->base, depth, __flags, &ret,
+                depth ? &lvl[depth - 1].skip : NULL, NULL)) goto end;
+            if(depth) lv->fh->Close(lv->fh);
+            depth--;
+            continue;
+        }
+        if(info.FileName[0] == L'.' && (!info.FileName[1] || (info.FileName[1] == L'.' && !info.FileName[2])))
+            continue;
+        path[lv->len] = sep;
+#if USE_UTF8
+        len = (int)wcstombs(path + lv->len + 1, info.FileName, __FTW_PATH - lv->len - 2);
+#else
+        strncpy(path + lv->len + 1, info.FileName, __FTW_PATH - lv->len - 2);
+        len = (int)strlen(path + lv->len + 1);
+#endif
+        if(len < 0 || lv->len + 1 + len >= __FTW_PATH - 2) {
+            errno = ENAMETOOLONG;
+            ret = -1; goto end;
+        }
+        path[lv->len + 1 + len] = 0;
+        __stat_info(&info, &st);
+        if(!(info.Attribute & EFI_FILE_DIRECTORY)) {
+            if(__ftw_call(__fn, path, &st, FTW_F, lv->len + 1, depth + 1, __flags, &ret, &lv->skip, NULL)) goto end;
+            continue;
+        }
+        if(depth + 1 >= __FTW_DEPTH ||
+          EFI_ERROR(lv->fh->Open(lv->fh, &fh, info.FileName, EFI_FILE_MODE_READ, 0))) {
+            if(__ftw_call(__fn, path, &st, FTW_DNR, lv->len + 1, depth + 1, __flags, &ret, &lv->skip, NULL)) goto end;
+            continue;
+        }
+        skip = 0;
+        if(pre && __ftw_call(__fn, path, &st, FTW_D, lv->len + 1, depth + 1, __flags, &ret, &lv->skip, &skip)) {
+            fh->Close(fh);
+            goto end;
+        }
+        if(skip) {
+            fh->Close(fh);
+            continue;
+        }
+        depth++;
+        lvl[depth].fh = fh;
+        memcpy(&lvl[depth].st, &st, sizeof(struct stat));
+        lvl[depth].base = lv->len + 1;
+        lvl[depth].len = lv->len + 1 + len;
+        lvl[depth].skip = 0;
+    }
+end:
+    for(; depth > 0; depth--)
+        lvl[depth].fh->Close(lvl[depth].fh);
+    free(lvl);
+    fclose(f);
+    return ret;
+}
+
+int closedir (DIR *__dirp)
+{
+    return fclose((FILE*)__dirp);
+}
@@ -0,0 +1,373 @@
+/*
+ * lz4.c
+ *
+ * Copyright (C) 2021 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the POSIX-UEFI package.
+ * @brief Implementing LZ4 frame decompression, for buffers and for fopen's decompressing streams
+ *
+ */
+
+#include <uefi.h>
+
+#define __LZ4_MAGIC     0x184D2204
+#define __LZ4_LEGACY    0x184C2102
+#define __LZ4_LEGBLK    (8 * 1024 * 1024)   /* legacy frames have fixed 8M blocks */
+#define __LZ4_HIST      65536               /* matches reach back at most this far */
+/* the fast loops copy 16 bytes at once, so they may write this much past the end of the data */
+#define __LZ4_WILD      16
+#define __LZ4_COPY8(d, s) __builtin_memcpy((d), (s), 8)
+#define __LZ4_COPY16(d, s) __builtin_memcpy((d), (s), 16)
+#define __LZ4_SKIPPABLE(m) (((m) & 0xFFFFFFF0) == 0x184D2A50)
+
+static uint32_t __lz4_le32 (const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Decode one block into op. Matches may reach back to lowest. The decoder never writes past op + olen + slack,
+ * and uses the wild copies only where both that and the input's end are far enough. Returns the decoded size or -1.
+ */
+intn_t __lz4_block (const uint8_t *ip, size_t ilen, uint8_t *op, size_t olen, const uint8_t *lowest, size_t slack)
+{
+    const uint8_t *iend = ip + ilen, *match;
+    uint8_t *ostart = op, *oend = op + olen, *cpy;
+    size_t lit, ml, off, s;
+    uint32_t tok;
+    if(slack > __LZ4_WILD) slack = __LZ4_WILD;
+    while(ip < iend) {
+        tok = *ip++;
+        if((lit = tok >> 4) == 15)
+            do { if(ip >= iend) return -1; s = *ip++; lit += s; } while(s == 255);
+        if(lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        cpy = op + lit;
+        if((size_t)(iend - ip) >= __LZ4_WILD && lit <= (size_t)(iend - ip) - __LZ4_WILD && (size_t)(oend - cpy) + slack >= __LZ4_WILD) {
+            match = ip;
+            do { __LZ4_COPY16(op, ip); op += 16; ip += 16; } while(op < cpy);
+            ip = match + lit;
+        } else
+            for(; op < cpy; ) *op++ = *ip++;
+        op = cpy;
+        /* the last sequence has only literals */
+        if(ip >= iend) break;
+        if(iend - ip < 2) return -1;
+        off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if(!off || off > (size_t)(op - lowest)) return -1;
+        if((ml = tok & 15) == 15)
+            do { if(ip >= iend) return -1; s = *ip++; ml += s; } while(s == 255);
+        ml += 4;
+        if(ml > (size_t)(oend - op)) return -1;
+        match = op - off;
+        cpy = op + ml;
+        if(off >= 8 && (size_t)(oend - cpy) + slack >= __LZ4_WILD) {
+            do { __LZ4_COPY8(op, match); op += 8; match += 8; } while(op < cpy);
+            op = cpy;
+        } else
+            /* overlapping repeats of a short pattern */
+            for(; op < cpy; ) *op++ = *match++;
+    }
+    return (intn_t)(op - ostart);
+}
+
+/**
+ * Parse a frame header at p (after the magic). Returns the header's size or -1, and the block maximum size, the flags
+ * and the content size (0 if not stored).
+ */
+int __lz4_header (const uint8_t *p, size_t len, size_t *bmax, uint8_t *flg, uint64_t *csize)
+{
+    int n = 3;
+    if(len < 3 || (p[0] & 0xC2) != 0x40 || (p[1] & 0x8F) || ((p[1] >> 4) & 7) < 4) return -1;
+    *flg = p[0];
+    *bmax = (size_t)1 << (8 + 2 * ((p[1] >> 4) & 7));
+    *csize = 0;
+    if(p[0] & 8) {
+        if(len < 11) return -1;
+        *csize = (uint64_t)__lz4_le32(p + 2) | (uint64_t)__lz4_le32(p + 6) << 32;
+        n += 8;
+    }
+    /* dictionary id, only accepted because we don't use dictionaries */
+    if(p[0] & 1) n += 4;
+    return (size_t)n <= len ? n : -1;
+}
+
+size_t lz4_size (const void *__src, size_t __srclen)
+{
+    const uint8_t *p = (const uint8_t*)__src;
+    size_t bmax;
+    uint8_t flg;
+    uint64_t csize;
+    if(!p || __srclen < 7 || __lz4_le32(p) != __LZ4_MAGIC || __lz4_header(p + 4, __srclen - 4, &bmax, &flg, &csize) < 0)
+        return 0;
+    return (size_t)csize;
+}
+
+ssize_t lz4_decompress (const void *__src, size_t __srclen, void *__dst, size_t __dstlen)
+{
+    const uint8_t *ip = (const uint8_t*)__src, *iend = ip + __srclen;
+    uint8_t *op = (uint8_t*)__dst, *oend = op + __dstlen, *lowest;
+    size_t bmax, bs, o;
+    uint32_t m;
+    uint8_t flg;
+    uint64_t csize;
+    intn_t r;
+    int legacy;
+    if(!__src || !__dst) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* frames may be concatenated */
+    while(iend - ip >= 4) {
+        m = __lz4_le32(ip); ip += 4;
+        if(__LZ4_SKIPPABLE(m)) {
+            if(iend - ip < 4 || __lz4_le32(ip) > (size_t)(iend - ip) - 4) goto corrupt;
+            ip += 4 + __lz4_le32(ip);
+            continue;
+        }
+        if((legacy = m == __LZ4_LEGACY)) { bmax = __LZ4_LEGBLK; flg = 0x20; }
+        else if(m != __LZ4_MAGIC || (r = __lz4_header(ip, (size_t)(iend - ip), &bmax, &flg, &csize)) < 0) goto corrupt;
+        else ip += r;
+        lowest = op;
+        while(1) {
+            if(iend - ip < 4) { if(legacy) break; goto corrupt; }
+            bs = __lz4_le32(ip);
+            /* legacy frames end at the end of the data or where another frame starts */
+            if(legacy && (bs == __LZ4_MAGIC || bs == __LZ4_LEGACY || __LZ4_SKIPPABLE(bs))) break;
+            ip += 4;
+            if(!bs && !legacy) break;
+            if((bs & 0x7FFFFFFF) > (size_t)(iend - ip)) goto corrupt;
+            /* with independent blocks, matches can't reach into previous ones */
+            if(flg & 0x20) lowest = op;
+            o = (size_t)(oend - op) < bmax ? (size_t)(oend - op) : bmax;
+            if((bs & 0x80000000) && !legacy) {
+                bs &= 0x7FFFFFFF;
+                if(bs > o) goto nospace;
+                memcpy(op, ip, bs);
+                r = (intn_t)bs;
+            } else {
+                /* anything after this block's maximum will be overwritten by the next one, so it's the slack */
+                if((r = __lz4_block(ip, bs, op, o, lowest, (size_t)(oend - op) - o)) < 0) {
+                    if(o < bmax) goto nospace;
+                    goto corrupt;
+                }
+            }
+            ip += bs;
+            op += r;
+            /* block checksums aren't verified */
+            if((flg & 0x10) && !legacy) ip += 4;
+        }
+        if((flg & 4) && !legacy) ip += 4;
+    }
+    return (ssize_t)(op - (uint8_t*)__dst);
+nospace:
+    errno = ENOSPC;
+    return -1;
+corrupt:
+    errno = EINVAL;
+    return -1;
+}
+
+/*** decompressing streams, blocks are read with fread and decoded into a buffer which keeps the history ***/
+#define __LZ4S_FRAME    0
+#define __LZ4S_BLOCK    1
+#define __LZ4S_END      2
+/* with linked blocks the history is only moved to the front when this much has been decoded */
+#define __LZ4_AREA      (4 * 1024 * 1024)
+typedef struct {
+    FILE *src;
+    uint8_t *in, *out;
+    size_t insiz, outsiz;
+    size_t bmax;
+    size_t lo, pos, len;            /* valid history, and the unread data in out */
+    uint32_t magic;                 /* a legacy frame ended at the next frame's magic */
+    uint8_t flg;
+    int legacy, state;
+} __lz4s_t;
+
+static void __lz4_copy (uint8_t *d, const uint8_t *s, size_t n)
+{
+    for(; n >= 16; n -= 16, d += 16, s += 16) __LZ4_COPY16(d, s);
+    while(n--) *d++ = *s++;
+}
+
+static int __lz4_get (__lz4s_t *z, void *p, size_t n)
+{
+    return fread(p, 1, n, z->src) == n ? 0 : -1;
+}
+
+/* start of a frame. Returns 0 at the end of the data, -1 on error */
+static int __lz4_frame (__lz4s_t *z)
+{
+    uint8_t hdr[16];
+    uint64_t csize;
+    uint32_t m;
+    size_t n, insiz, outsiz;
+    void *p;
+    while(1) {
+        if(z->magic) { m = z->magic; z->magic = 0; }
+        else {
+            if(!(n = fread(hdr, 1, 4, z->src))) return 0;
+            if(n < 4) return -1;
+            m = __lz4_le32(hdr);
+        }
+        if(!__LZ4_SKIPPABLE(m)) break;
+        if(__lz4_get(z, hdr, 4) || fseek(z->src, (long int)__lz4_le32(hdr), SEEK_CUR)) return -1;
+    }
+    if((z->legacy = m == __LZ4_LEGACY)) {
+        z->bmax = __LZ4_LEGBLK;
+        z->flg = 0x20;
+    } else {
+        if(m != __LZ4_MAGIC || __lz4_get(z, hdr, 2)) return -1;
+        n = 3 + (hdr[0] & 8 ? 8 : 0) + (hdr[0] & 1 ? 4 : 0);
+        if(__lz4_get(z, hdr + 2, n - 2) || __lz4_header(hdr, n, &z->bmax, &z->flg, &csize) < 0) return -1;
+    }
+    /* a compressed block can be slightly bigger than the uncompressed one */
+    insiz = z->bmax + z->bmax / 255 + 16;
+    outsiz = __LZ4_HIST + (z->bmax < __LZ4_AREA && !(z->flg & 0x20) ? __LZ4_AREA : z->bmax) + __LZ4_WILD;
+    if(insiz > z->insiz) {
+        if(!(p = realloc(z->in, insiz))) return -1;
+        z->in = (uint8_t*)p; z->insiz = insiz;
+    }
+    if(outsiz > z->outsiz) {
+        if(!(p = realloc(z->out, outsiz))) return -1;
+        z->out = (uint8_t*)p; z->outsiz = outsiz;
+    }
+    z->lo = z->pos = z->len = __LZ4_HIST;
+    z->state = __LZ4S_BLOCK;
+    return 1;
+}
+
+/* decode the next block into out. Returns 0 at the end of the data, -1 on error */
+static int __lz4_next (__lz4s_t *z)
+{
+    uint8_t tmp[4];
+    uint32_t bs;
+    size_t n, keep;
+    intn_t r;
+    while(1) {
+        if(z->state == __LZ4S_END) return 0;
+        if(z->state == __LZ4S_FRAME && (r = __lz4_frame(z)) < 1) return (int)r;
+        if(!(n = fread(tmp, 1, 4, z->src)) && z->legacy) { z->state = __LZ4S_END; return 0; }
+        if(n < 4) return -1;
+        bs = __lz4_le32(tmp);
+        if(z->legacy && (bs == __LZ4_MAGIC || bs == __LZ4_LEGACY || __LZ4_SKIPPABLE(bs))) {
+            z->magic = bs;
+            z->state = __LZ4S_FRAME;
+            continue;
+        }
+        if(!bs && !z->legacy) {
+            if((z->flg & 4) && __lz4_get(z, tmp, 4)) return -1;
+            z->state = __LZ4S_FRAME;
+            continue;
+        }
+        n = z->legacy ? bs : bs & 0x7FFFFFFF;
+        if(n > z->insiz || __lz4_get(z, z->in, n)) return -1;
+        /* make room, keeping the last 64k for linked blocks */
+        if(z->len + z->bmax + __LZ4_WILD > z->outsiz) {
+            keep = z->flg & 0x20 ? 0 : (z->len - z->lo < __LZ4_HIST ? z->len - z->lo : __LZ4_HIST);
+            __lz4_copy(z->out + __LZ4_HIST - keep, z->out + z->len - keep, keep);
+            z->lo = __LZ4_HIST - keep;
+            z->len = __LZ4_HIST;
+        }
+        if(z->flg & 0x20) z->lo = z->len;
+        if(!z->legacy && (bs & 0x80000000)) {
+            if(n > z->bmax) return -1;
+            __lz4_copy(z->out + z->len, z->in, n);
+            r = (intn_t)n;
+        } else
+        if((r = __lz4_block(z->in, n, z->out + z->len, z->bmax, z->out + z->lo, __LZ4_WILD)) < 0) return -1;
+        if(!z->legacy && (z->flg & 0x10) && __lz4_get(z, tmp, 4)) return -1;
+        z->pos = z->len;
+        z->len += (size_t)r;
+        if(r) return 1;
+    }
+}
+
+/**
+ * Start decompressing src, which must be at the beginning of a frame. Returns NULL if it isn't LZ4 data
+ */
+void *__lz4_open (FILE *src, off_t *size)
+{
+    __lz4s_t *z;
+    uint8_t hdr[16];
+    size_t bmax;
+    uint8_t flg;
+    uint64_t csize = 0;
+    size_t n = fread(hdr, 1, 15, src);
+    if(fseek(src, 0, SEEK_SET) || n < 7) return NULL;
+    if(__lz4_le32(hdr) == __LZ4_MAGIC) {
+        if(__lz4_header(hdr + 4, 11, &bmax, &flg, &csize) < 0) return NULL;
+    } else if(__lz4_le32(hdr) != __LZ4_LEGACY) return NULL;
+    if(!(z = (__lz4s_t*)malloc(sizeof(__lz4s_t)))) return NULL;
+    memset(z, 0, sizeof(__lz4s_t));
+    z->src = src;
+    *size = (off_t)csize;
+    return z;
+}
+
+size_t __lz4_read (void *s, void *__ptr, size_t __n)
+{
+    __lz4s_t *z = (__lz4s_t*)s;
+    uint8_t *out = (uint8_t*)__ptr;
+    size_t k;
+    int r;
+    while(__n) {
+        if(z->pos == z->len) {
+            if((r = __lz4_next(z)) < 1) {
+                if(r < 0) errno = EIO;
+                z->state = __LZ4S_END;
+                break;
+            }
+        }
+        k = z->len - z->pos < __n ? z->len - z->pos : __n;
+        __lz4_copy(out, z->out + z->pos, k);
+        z->pos += k; out += k; __n -= k;
+    }
+    return (size_t)(out - (uint8_t*)__ptr);
+}
+
+int __lz4_eof (void *s)
+{
+    __lz4s_t *z = (__lz4s_t*)s;
+    return z->state == __LZ4S_END && z->pos == z->len;
+}
+
+/* start again from the beginning of the source */
+int __lz4_reset (void *s)
+{
+    __lz4s_t *z = (__lz4s_t*)s;
+    z->state = __LZ4S_FRAME;
+    z->magic = 0;
+    z->lo = z->pos = z->len = __LZ4_HIST;
+    return fseek(z->src, 0, SEEK_SET);
+}
+
+void __lz4_close (void *s)
+{
+    __lz4s_t *z = (__lz4s_t*)s;
+    fclose(z->src);
+    if(z->in) free(z->in);
+    if(z->out) free(z->out);
+    free(z);
+}
@@ -0,0 +1,92 @@
+/*
+ * resource.c
+ *
+ * Copyright (C) 2021 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the POSIX-UEFI package.
+ * @brief Implementing lookup of files embedded into the image at build time
+ *
+ */
+
+#include <uefi.h>
+
+
+/* The Makefile turns the files under RESDIR into resources.o, and the linker script collects its .resources section
+ * between these two symbols. It starts with the number of files, followed by one record per file sorted by name, then
+ * the zero terminated UTF-8 names, and the data of each file aligned to 16 bytes. */
+#ifndef __clang__
+extern const uint8_t __resources[], __resources_end[];
+#endif
+
+typedef struct {
+    uint64_t name;                  /* offsets from the start of the index */
+    uint64_t data;
+    uint64_t size;
+} __res_t;
+
+/* compare an embedded name with the one looked up, byte by byte in UTF-8, backslashes match slashes */
+static int __res_cmp (const char *s, const char_t *name)
+{
+    char u[4];
+    int i, n;
+    for(;; name++) {
+#if USE_UTF8
+        u[0] = *name == CL('\\') ? '/' : *name;
+        n = 1;
+#else
+        n = wctomb(u, *name == CL('\\') ? L'/' : *name);
+#endif
+        for(i = 0; i < n; i++, s++)
+            if(*s != u[i]) return (uint8_t)*s - (uint8_t)u[i];
+        if(!*name) return 0;
+    }
+}
+
+const void *resource_get (const char_t *__name, size_t *__size)
+{
+#ifndef __clang__
+    const __res_t *res = (const __res_t*)(__resources + 8);
+    uint64_t lo = 0, hi, mid;
+    int c;
+#endif
+    if(__size) *__size = 0;
+    if(!__name) {
+        errno = EINVAL;
+        return NULL;
+    }
+#ifndef __clang__
+    while(*__name == CL('/') || *__name == CL('\\')) __name++;
+    hi = __resources_end - __resources >= 8 ? *(const uint64_t*)__resources : 0;
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        c = __res_cmp((const char*)__resources + res[mid].name, __name);
+        if(!c) {
+            if(__size) *__size = (size_t)res[mid].size;
+            return __resources + res[mid].data;
+        }
+        if(c < 0) lo = mid + 1; else hi = mid;
+    }
+#endif
+    errno = ENOENT;
+    return NULL;
+}
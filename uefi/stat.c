@@ -32,6 +32,21 @@
 
 /* fstat is in stdio.c because we can't access static variables otherwise... */
 
+extern time_t __mktime_efi(efi_time_t *t);
+
+/* convert a file info record, used by fstat and by the directory functions */
+void __stat_info (efi_file_info_t *info, struct stat *__buf)
+{
+    __buf->st_mode = S_IREAD |
+        (info->Attribute & EFI_FILE_READ_ONLY ? 0 : S_IWRITE) |
+        (info->Attribute & EFI_FILE_DIRECTORY ? S_IFDIR : S_IFREG);
+    __buf->st_size = (off_t)info->FileSize;
+    __buf->st_blocks = (blkcnt_t)info->PhysicalSize;
+    __buf->st_atime = __mktime_efi(&info->LastAccessTime);
+    __buf->st_mtime = __mktime_efi(&info->ModificationTime);
+    __buf->st_ctime = __mktime_efi(&info->CreateTime);
+}
+
 int stat (const char_t *__file, struct stat *__buf)
 {
     int ret;
@@ -30,113 +30,1634 @@
 
 #include <uefi.h>
 
+/* console output buffer size, in UTF-16 characters */
+#define __CONBUFSIZ 1024
+/* default serial tee ring buffer size in bytes, and its drain period in 100ns units */
+#ifndef __TEEBUFSIZ
+#define __TEEBUFSIZ 4096
+#endif
+#define __TEE_PERIOD 500000
+/* default serial receive ring size in bytes */
+#ifndef __SERBUFSIZ
+#define __SERBUFSIZ 4096
+#endif
+/* number of directory handles kept open by fopen, and the longest directory path cached */
+#ifndef __DIRCACHE
+#define __DIRCACHE 8
+#endif
+#define __DIRCACHEPATH 256
+/* longest path passed to the firmware */
+#ifndef __PATHMAX
+#define __PATHMAX 1024
+#endif
+/* readv / writev bounce buffer for small segments */
+#ifndef __IOVBUFSIZ
+#define __IOVBUFSIZ 65536
+#endif
+/* compressed data is read in chunks of this size by decompressing streams */
+#ifndef __GZBUFSIZ
+#define __GZBUFSIZ 16384
+#endif
+/* size of each of copy_file_range's two buffers */
+#ifndef __COPYBUFSIZ
+#define __COPYBUFSIZ (1024*1024)
+#endif
+
 static efi_file_handle_t *__root_dir = NULL;
+static efi_handle_t *__vol_handles = NULL;
+static efi_file_handle_t **__vol_roots = NULL;
+static uintn_t __vol_n = 0;
 static efi_serial_io_protocol_t *__ser = NULL;
-static block_file_t *__blk_devs = NULL;
+static efi_block_io_t **__blk_devs = NULL;
+static efi_block_io2_t **__blk_devs2 = NULL;
 static uintn_t __blk_ndevs = 0;
-extern time_t __mktime_efi(efi_time_t *t);
+extern efi_file_handle_t *__tmpfs_root(void);
+extern void __tmpfs_cleanup(void);
+extern int __archive_find(const char_t *__path, void **__ent);
+extern uint8_t *__archive_entry(void *__ent, struct stat *__buf);
+extern void __archive_cleanup(void);
+extern void *__lz4_open(FILE *src, off_t *size);
+extern size_t __lz4_read(void *s, void *__ptr, size_t __n);
+extern int __lz4_eof(void *s);
+extern int __lz4_reset(void *s);
+extern void __lz4_close(void *s);
+extern void __stat_info(efi_file_info_t *info, struct stat *__buf);
+
+void __stdio_seterrno(efi_status_t status)
+{
+    switch((int)(status & 0xffff)) {
+        case EFI_WRITE_PROTECTED & 0xffff: errno = EROFS; break;
+        case EFI_ACCESS_DENIED & 0xffff: errno = EACCES; break;
+        case EFI_VOLUME_FULL & 0xffff: errno = ENOSPC; break;
+        case EFI_NOT_FOUND & 0xffff: errno = ENOENT; break;
+        case EFI_INVALID_PARAMETER & 0xffff: errno = EINVAL; break;
+        case EFI_TIMEOUT & 0xffff: errno = ETIMEDOUT; break;
+        default: errno = EIO; break;
+    }
+}
+
+/**
+ * Locate the serial port. Baud rate 0 keeps the settings of an already located port, zero FIFO depth and timeout
+ * are the firmware's defaults
+ */
+static int __ser_init (uintn_t __baud, uint32_t __fifo, uint32_t __timeout)
+{
+    efi_guid_t serGuid = EFI_SERIAL_IO_PROTOCOL_GUID;
+    efi_status_t status;
+    if(!__ser) {
+        status = BS->LocateProtocol(&serGuid, NULL, (void**)&__ser);
+        if(EFI_ERROR(status) || !__ser) {
+            __ser = NULL;
+            errno = ENOENT;
+            return 0;
+        }
+        if(!__baud) __baud = 115200;
+    }
+    if(__baud)
+        __ser->SetAttributes(__ser, __baud, __fifo, __timeout ? __timeout : 1000, NoParity, 8, OneStopBit);
+    return 1;
+}
+
+/*** console output copied to the serial port through a ring buffer ***/
+static char __tee_def[__TEEBUFSIZ];
+static char *__tee_buf = NULL;
+static size_t __tee_siz = 0;
+static uint64_t __tee_head = 0, __tee_tail = 0;    /* bytes put into the ring and sent to the serial port so far */
+static efi_event_t __tee_ev = NULL;
+static int __tee_on = 0;
+static volatile int __tee_busy = 0;
+
+/* send everything that's pending in the ring in one or two batches */
+static void __tee_drain (void)
+{
+    uintn_t n;
+    size_t o;
+    while(__tee_tail < __tee_head) {
+        o = (size_t)(__tee_tail % __tee_siz);
+        n = (uintn_t)(__tee_head - __tee_tail);
+        if(n > __tee_siz - o) n = __tee_siz - o;
+        /* drop the data on errors, the console must not block on the serial port */
+        if(EFI_ERROR(__ser->Write(__ser, &n, __tee_buf + o)) || !n) {
+            __tee_tail = __tee_head;
+            break;
+        }
+        __tee_tail += n;
+    }
+}
+
+/* periodic timer, drains the ring unless the console is just writing into it */
+static void EFIAPI __tee_timer (efi_event_t __event, void *__ctx)
+{
+    (void)__event; (void)__ctx;
+    if(__tee_on && !__tee_busy) __tee_drain();
+}
+
+static void __tee_put (wchar_t __c)
+{
+    char tmp[4];
+    int i, n = wctomb(tmp, __c);
+    __tee_busy = 1;
+    for(i = 0; i < n; i++) {
+        if(__tee_head - __tee_tail >= __tee_siz) __tee_drain();
+        __tee_buf[__tee_head++ % __tee_siz] = tmp[i];
+    }
+    if(__c == L'\n') __tee_drain();
+    __tee_busy = 0;
+}
+
+static void __tee_stop (void)
+{
+    if(!__tee_on) return;
+    __tee_drain();
+    if(__tee_ev) {
+        BS->CloseEvent(__tee_ev);
+        __tee_ev = NULL;
+    }
+    __tee_on = 0;
+}
+
+/**
+ * Copy everything written to stdout and stderr to the serial port. With NULL buffer a static ring is used,
+ * size 0 turns copying off
+ */
+int stdio_tee (char *__buf, size_t __size)
+{
+    efi_status_t status;
+    __tee_stop();
+    __tee_buf = NULL;
+    __tee_siz = 0;
+    __tee_head = __tee_tail = 0;
+    if(!__size) return 0;
+    if(!__ser_init(0, 0, 0)) return -1;
+    if(!__buf) {
+        __buf = __tee_def;
+        if(__size > sizeof(__tee_def)) __size = sizeof(__tee_def);
+    }
+    __tee_buf = __buf;
+    __tee_siz = __size;
+    __tee_on = 1;
+    /* without the timer the ring is still drained on new lines and when it's full */
+    status = BS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, __tee_timer, NULL, &__tee_ev);
+    if(!EFI_ERROR(status) && EFI_ERROR(BS->SetTimer(__tee_ev, TimerPeriodic, __TEE_PERIOD))) {
+        BS->CloseEvent(__tee_ev);
+        __tee_ev = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Get the last output kept in the ring, also works after exit_bs, abort or a longjmp out of a crash
+ */
+size_t stdio_tee_log (char *__buf, size_t __n)
+{
+    uint64_t s;
+    size_t i = 0;
+    if(!__buf || !__n) return 0;
+    s = __tee_head > __tee_siz ? __tee_head - __tee_siz : 0;
+    if(__tee_head - s > __n - 1) s = __tee_head - (__n - 1);
+    for(; s < __tee_head; s++) __buf[i++] = __tee_buf[s % __tee_siz];
+    __buf[i] = 0;
+    return i;
+}
+
+/*** console streams, stdin, stdout and stderr ***/
+static size_t __con_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    (void)__stream; (void)__ptr; (void)__n;
+    errno = ESPIPE;
+    return 0;
+}
+
+static int __con_flush (FILE *__stream)
+{
+    simple_text_output_interface_t *con = __stream == stderr ? ST->StdErr : ST->ConOut;
+    wchar_t *buf = (wchar_t*)__stream->buf;
+    if(__stream->buflen) {
+        if(buf[__stream->buflen - 1] == L'\r') __stream->flags |= __FF_CR;
+        else __stream->flags &= ~__FF_CR;
+        buf[__stream->buflen] = 0;
+        __stream->buflen = 0;
+        if(EFI_ERROR(con->OutputString(con, buf))) {
+            errno = EIO;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* add one UTF-16 character to the console buffer */
+static void __con_put (FILE *__stream, wchar_t __c)
+{
+    wchar_t *buf = (wchar_t*)__stream->buf;
+    /* room for a carriage return, the character and the terminating zero */
+    if(__stream->buflen + 3 > __stream->bufsiz) __con_flush(__stream);
+    /* UEFI needs carrige return before new lines */
+    if(__c == L'\n' && (__stream->buflen ? buf[__stream->buflen - 1] != L'\r' : !(__stream->flags & __FF_CR))) {
+        buf[__stream->buflen++] = L'\r';
+        if(__tee_on) __tee_put(L'\r');
+    }
+    buf[__stream->buflen++] = __c;
+    if(__tee_on) __tee_put(__c);
+}
+
+static size_t __con_write (FILE *__stream, const void *__ptr, size_t __n)
+{
+    const char_t *s = (const char_t*)__ptr, *e = s + __n / sizeof(char_t);
+    wchar_t c;
+    int nl = 0;
+#if USE_UTF8
+    int r;
+#endif
+    if(__stream == stdin) {
+        errno = EBADF;
+        return 0;
+    }
+    while(s < e) {
+#if USE_UTF8
+        r = mbtowc(&c, s, e - s);
+        if(r < 1) { s++; continue; }
+        s += r;
+#else
+        c = *s++;
+#endif
+        if(!c) continue;
+        if(c == L'\n') nl = 1;
+        __con_put(__stream, c);
+    }
+    if((__stream->flags & __FF_NBF) || (nl && (__stream->flags & __FF_LBF))) __con_flush(__stream);
+    return __n;
+}
+
+static int __con_seek (FILE *__stream, int64_t __off, int __whence)
+{
+    (void)__stream; (void)__off; (void)__whence;
+    errno = ESPIPE;
+    return -1;
+}
+
+static off_t __con_tell (FILE *__stream)
+{
+    (void)__stream;
+    errno = ESPIPE;
+    return (off_t)-1;
+}
+
+static int __con_eof (FILE *__stream)
+{
+    (void)__stream;
+    errno = ESPIPE;
+    return 0;
+}
+
+static int __con_nop (FILE *__stream)
+{
+    (void)__stream;
+    return 1;
+}
+
+static int __con_stat (FILE *__stream, struct stat *__buf)
+{
+    __buf->st_mode = (__stream == stdin ? S_IREAD : S_IWRITE) | S_IFIFO;
+    return 0;
+}
+
+static const __file_ops_t __con_ops = {
+    __con_read, __con_write, __con_seek, __con_tell, __con_eof, __con_flush, __con_nop, __con_stat
+};
+
+/*** Serial IO streams, buf is a ring of received bytes starting at offset ***/
+static size_t __ser_get (FILE *__stream, uint8_t *__ptr, size_t __n)
+{
+    uint8_t *buf = (uint8_t*)__stream->buf;
+    size_t i = 0, l;
+    while(i < __n && __stream->buflen) {
+        l = __stream->bufsiz - (size_t)__stream->offset;
+        if(l > __stream->buflen) l = __stream->buflen;
+        if(l > __n - i) l = __n - i;
+        memcpy(__ptr + i, buf + __stream->offset, l);
+        i += l;
+        __stream->buflen -= l;
+        __stream->offset += l;
+        if((size_t)__stream->offset == __stream->bufsiz) __stream->offset = 0;
+    }
+    return i;
+}
+
+/* read only what the port has already received */
+static size_t __ser_avail (efi_serial_io_protocol_t *__ser, uint8_t *__ptr, size_t __n)
+{
+    uint32_t ctl;
+    uintn_t bs;
+    size_t i;
+    for(i = 0; i < __n; i += bs) {
+        if(EFI_ERROR(__ser->GetControl(__ser, &ctl)) || (ctl & EFI_SERIAL_INPUT_BUFFER_EMPTY)) break;
+        bs = 1;
+        if(EFI_ERROR(__ser->Read(__ser, &bs, __ptr + i)) || !bs) break;
+    }
+    return i;
+}
+
+static size_t __ser_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    uint8_t *ptr = (uint8_t*)__ptr, *buf = (uint8_t*)__stream->buf;
+    efi_status_t status = EFI_SUCCESS;
+    uintn_t bs;
+    size_t got, h, l;
+    got = __ser_get(__stream, ptr, __n);
+    /* bulk transfer straight into the caller's buffer, until everything arrives or the line is idle for the timeout */
+    if(got < __n && !(__stream->flags & __FF_NONBLOCK)) {
+        bs = __n - got;
+        status = __stream->h.ser->Read(__stream->h.ser, &bs, ptr + got);
+        got += bs;
+    }
+    if(got < __n) got += __ser_avail(__stream->h.ser, ptr + got, __n - got);
+    /* move whatever else has arrived into the ring, so that the port's FIFO doesn't overrun until the next read */
+    while(buf && __stream->buflen < __stream->bufsiz) {
+        h = ((size_t)__stream->offset + __stream->buflen) % __stream->bufsiz;
+        l = h < (size_t)__stream->offset ? (size_t)__stream->offset - h : __stream->bufsiz - h;
+        bs = __ser_avail(__stream->h.ser, buf + h, l);
+        __stream->buflen += bs;
+        if(bs < l) break;
+    }
+    if(!got) {
+        if(__stream->flags & __FF_NONBLOCK) errno = EAGAIN;
+        else __stdio_seterrno(EFI_ERROR(status) ? status : EFI_TIMEOUT);
+    }
+    return got;
+}
+
+static size_t __ser_write (FILE *__stream, const void *__ptr, size_t __n)
+{
+    uintn_t bs = __n;
+    efi_status_t status = __stream->h.ser->Write(__stream->h.ser, &bs, (void*)__ptr);
+    if(EFI_ERROR(status) && !bs) {
+        __stdio_seterrno(status);
+        return 0;
+    }
+    return bs;
+}
+
+static int __ser_seek (FILE *__stream, int64_t __off, int __whence)
+{
+    (void)__stream; (void)__off; (void)__whence;
+    errno = EBADF;
+    return -1;
+}
+
+static off_t __ser_tell (FILE *__stream)
+{
+    (void)__stream;
+    errno = EBADF;
+    return (off_t)-1;
+}
+
+static int __ser_eof (FILE *__stream)
+{
+    (void)__stream;
+    errno = EBADF;
+    return 0;
+}
+
+static int __ser_close (FILE *__stream)
+{
+    if(__stream->flags & __FF_FREEBUF)
+        free(__stream->buf);
+    return 1;
+}
+
+static int __ser_stat (FILE *__stream, struct stat *__buf)
+{
+    __buf->st_mode = S_IREAD | S_IWRITE | S_IFCHR;
+    __buf->st_size = __stream->buflen;
+    return 0;
+}
+
+static const __file_ops_t __ser_ops = {
+    __ser_read, __ser_write, __ser_seek, __ser_tell, __ser_eof, __con_nop, __ser_close, __ser_stat
+};
+
+/*** UART driven directly with polling, works after ExitBootServices too ***/
+#define __UART_IO       1   /* 16550 in port IO space */
+#define __UART_MMIO8    2   /* 16550 with byte wide registers */
+#define __UART_MMIO32   3   /* 16550 with 32 bit wide registers */
+#define __UART_PL011    4
+/* how many times the status register is polled for the next byte before a read returns */
+#define __UART_IDLE     100000
+
+static uintptr_t __uart_base = 0;
+static int __uart_type = 0;
+
+static uint32_t __uart_in (int __reg)
+{
+#ifdef __x86_64__
+    uint8_t v;
+    if(__uart_type == __UART_IO) {
+        __asm__ __volatile__ ("inb %w1, %0" : "=a"(v) : "Nd"((uint16_t)(__uart_base + __reg)));
+        return v;
+    }
+#endif
+    switch(__uart_type) {
+        case __UART_MMIO8: return *((volatile uint8_t*)(__uart_base + __reg));
+        case __UART_MMIO32: return *((volatile uint32_t*)(__uart_base + __reg * 4));
+        default: return *((volatile uint32_t*)(__uart_base + __reg));
+    }
+}
+
+static void __uart_out (int __reg, uint32_t __val)
+{
+#ifdef __x86_64__
+    if(__uart_type == __UART_IO) {
+        __asm__ __volatile__ ("outb %0, %w1" : : "a"((uint8_t)__val), "Nd"((uint16_t)(__uart_base + __reg)));
+        return;
+    }
+#endif
+    switch(__uart_type) {
+        case __UART_MMIO8: *((volatile uint8_t*)(__uart_base + __reg)) = (uint8_t)__val; break;
+        case __UART_MMIO32: *((volatile uint32_t*)(__uart_base + __reg * 4)) = __val; break;
+        default: *((volatile uint32_t*)(__uart_base + __reg)) = __val; break;
+    }
+}
+
+/* line status or flag register bits, 16550 registers are indices, PL011 registers are offsets */
+#define __uart_txready() (__uart_type == __UART_PL011 ? !(__uart_in(0x18) & 0x20) : (__uart_in(5) & 0x20))
+#define __uart_rxready() (__uart_type == __UART_PL011 ? !(__uart_in(0x18) & 0x10) : (__uart_in(5) & 1))
+
+/* set the baud rate of a 16550 (8N1, FIFOs on, no interrupts). PL011 has an unknown clock, left as the firmware set it */
+static void __uart_baud (uintn_t __baud)
+{
+    uint32_t div = __baud && __baud <= 115200 ? 115200 / __baud : 1;
+    if(__uart_type == __UART_PL011) return;
+    __uart_out(1, 0);
+    __uart_out(3, 0x80);
+    __uart_out(0, div & 0xff);
+    __uart_out(1, div >> 8);
+    __uart_out(3, 0x03);
+    __uart_out(2, 0xC7);
+    __uart_out(4, 0x03);
+}
+
+/**
+ * Find the UART described by the ACPI SPCR table, or default to COM1 on x86_64
+ */
+static int __uart_init (void)
+{
+    efi_guid_t acpiGuid = ACPI_20_TABLE_GUID;
+    uint8_t *rsdp = NULL, *xsdt, *t;
+    uint64_t a;
+    uint32_t len;
+    uintn_t i;
+    if(__uart_type) return 1;
+    for(i = 0; i < ST->NumberOfTableEntries; i++)
+        if(!memcmp(&ST->ConfigurationTable[i].VendorGuid, &acpiGuid, sizeof(efi_guid_t)))
+            rsdp = (uint8_t*)ST->ConfigurationTable[i].VendorTable;
+    if(rsdp && !memcmp(rsdp, "RSD PTR ", 8) && rsdp[15] >= 2) {
+        memcpy(&a, rsdp + 24, 8);
+        xsdt = (uint8_t*)(uintptr_t)a;
+        memcpy(&len, xsdt + 4, 4);
+        for(t = xsdt + 36; t + 8 <= xsdt + len; t += 8) {
+            memcpy(&a, t, 8);
+            if(!a || memcmp((uint8_t*)(uintptr_t)a, "SPCR", 4)) continue;
+            t = (uint8_t*)(uintptr_t)a;
+            /* interface type at 36, base address structure at 40 */
+            memcpy(&a, t + 44, 8);
+            switch(t[36]) {
+                case 0x00: case 0x01: case 0x12:
+                    __uart_type = t[40] == 1 ? __UART_IO : (t[43] > 1 ? __UART_MMIO32 : __UART_MMIO8);
+                    break;
+                case 0x03: case 0x0e:
+                    __uart_type = __UART_PL011;
+                    break;
+            }
+            break;
+        }
+    }
+#ifdef __x86_64__
+    if(!__uart_type) { __uart_type = __UART_IO; a = 0x3F8; }
+#else
+    if(__uart_type == __UART_IO) __uart_type = 0;
+#endif
+    if(!__uart_type) {
+        errno = ENODEV;
+        return 0;
+    }
+    __uart_base = (uintptr_t)a;
+    return 1;
+}
+
+static size_t __uart_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    uint8_t *ptr = (uint8_t*)__ptr;
+    size_t i;
+    int idle;
+    for(i = 0; i < __n; i++) {
+        /* the first byte is waited for unless non-blocking, the rest only until the line is idle */
+        for(idle = 0; !__uart_rxready(); idle++)
+            if((i || (__stream->flags & __FF_NONBLOCK)) && idle >= (i ? __UART_IDLE : 0)) goto end;
+        ptr[i] = (uint8_t)__uart_in(0);
+    }
+end:if(!i) errno = EAGAIN;
+    return i;
+}
+
+static size_t __uart_write (FILE *__stream, const void *__ptr, size_t __n)
+{
+    const uint8_t *ptr = (const uint8_t*)__ptr;
+    size_t i;
+    (void)__stream;
+    for(i = 0; i < __n; i++) {
+        while(!__uart_txready());
+        __uart_out(0, ptr[i]);
+    }
+    return __n;
+}
+
+static const __file_ops_t __uart_ops = {
+    __uart_read, __uart_write, __ser_seek, __ser_tell, __ser_eof, __con_nop, __con_nop, __ser_stat
+};
+
+/*** Block IO streams ***/
+static size_t __blk_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    efi_block_io_t *bio = __stream->h.bio;
+    efi_status_t status;
+    __n = (__n / bio->Media->BlockSize) * bio->Media->BlockSize;
+    status = bio->ReadBlocks(bio, bio->Media->MediaId, __stream->offset / bio->Media->BlockSize, __n, __ptr);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        return 0;
+    }
+    __stream->offset += __n;
+    return __n;
+}
+
+static size_t __blk_write (FILE *__stream, const void *__ptr, size_t __n)
+{
+    efi_block_io_t *bio = __stream->h.bio;
+    efi_status_t status;
+    __n = (__n / bio->Media->BlockSize) * bio->Media->BlockSize;
+    status = bio->WriteBlocks(bio, bio->Media->MediaId, __stream->offset / bio->Media->BlockSize, __n, (void*)__ptr);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        return 0;
+    }
+    __stream->offset += __n;
+    return __n;
+}
+
+static int __blk_seek (FILE *__stream, int64_t __off, int __whence)
+{
+    efi_block_io_t *bio = __stream->h.bio;
+    int64_t end = (int64_t)bio->Media->BlockSize * (int64_t)bio->Media->LastBlock, off;
+    switch(__whence) {
+        case SEEK_END: off = end + __off; break;
+        case SEEK_CUR: off = (int64_t)__stream->offset + __off; break;
+        default: off = __off; break;
+    }
+    if(off < 0) off = 0;
+    if(off > end) off = end;
+    __stream->offset = (off / bio->Media->BlockSize) * bio->Media->BlockSize;
+    return 0;
+}
+
+static off_t __blk_tell (FILE *__stream)
+{
+    return __stream->offset;
+}
+
+static int __blk_eof (FILE *__stream)
+{
+    return __stream->offset == (off_t)__stream->h.bio->Media->BlockSize * (off_t)__stream->h.bio->Media->LastBlock;
+}
+
+static int __blk_flush (FILE *__stream)
+{
+    return !EFI_ERROR(__stream->h.bio->FlushBlocks(__stream->h.bio));
+}
+
+static int __blk_stat (FILE *__stream, struct stat *__buf)
+{
+    __buf->st_mode = S_IREAD | S_IWRITE | S_IFBLK;
+    __buf->st_size = (off_t)__stream->h.bio->Media->BlockSize * (off_t)__stream->h.bio->Media->LastBlock;
+    __buf->st_blocks = __stream->h.bio->Media->LastBlock;
+    return 0;
+}
+
+static const __file_ops_t __blk_ops = {
+    __blk_read, __blk_write, __blk_seek, __blk_tell, __blk_eof, __blk_flush, __con_nop, __blk_stat
+};
+
+/* Block IO 2 interface of the same device, NULL if the firmware doesn't provide one */
+static efi_block_io2_t *__blk_io2 (efi_block_io_t *bio)
+{
+    uintn_t i;
+    for(i = 0; __blk_devs2 && i < __blk_ndevs; i++)
+        if(__blk_devs[i] == bio) return __blk_devs2[i];
+    return NULL;
+}
+
+/*** Simple File System streams, position and size are cached in the FILE ***/
+static int __efi_sync (FILE *__stream)
+{
+    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
+    efi_file_info_t info;
+    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t);
+    uint64_t off = 0;
+    efi_status_t status;
+    if(!(__stream->flags & __FF_STALE)) return 0;
+    status = __stream->h.fh->GetPosition(__stream->h.fh, &off);
+    if(!EFI_ERROR(status))
+        status = __stream->h.fh->GetInfo(__stream->h.fh, &infGuid, &fsiz, &info);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        return -1;
+    }
+    __stream->offset = (off_t)off;
+    __stream->size = (off_t)info.FileSize;
+    __stream->flags &= ~__FF_STALE;
+    return 0;
+}
+
+/* pread and pwrite move the firmware's position, but not the stream's */
+static int __efi_restore (FILE *__stream)
+{
+    efi_status_t status;
+    if(!(__stream->flags & __FF_MOVED)) return 0;
+    status = __stream->h.fh->SetPosition(__stream->h.fh, (uint64_t)__stream->offset);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        return -1;
+    }
+    __stream->flags &= ~__FF_MOVED;
+    return 0;
+}
+
+static size_t __efi_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    uintn_t bs = __n;
+    efi_status_t status;
+    if(__efi_sync(__stream) || __efi_restore(__stream)) return 0;
+    status = __stream->h.fh->Read(__stream->h.fh, &bs, __ptr);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        __stream->flags |= __FF_STALE;
+        return 0;
+    }
+    __stream->offset += bs;
+    /* short read, we are at the end of the file */
+    if(bs < __n || __stream->offset > __stream->size) __stream->size = __stream->offset;
+    return bs;
+}
+
+static size_t __efi_write (FILE *__stream, const void *__ptr, size_t __n)
+{
+    uintn_t bs = __n;
+    efi_status_t status;
+    if(__efi_sync(__stream) || __efi_restore(__stream)) return 0;
+    status = __stream->h.fh->Write(__stream->h.fh, &bs, (void*)__ptr);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        __stream->flags |= __FF_STALE;
+        return 0;
+    }
+    __stream->offset += bs;
+    if(__stream->offset > __stream->size) __stream->size = __stream->offset;
+    return bs;
+}
+
+static int __efi_seek (FILE *__stream, int64_t __off, int __whence)
+{
+    efi_status_t status;
+    if(__efi_sync(__stream)) return -1;
+    switch(__whence) {
+        case SEEK_END: __off += (int64_t)__stream->size; break;
+        case SEEK_CUR: __off += (int64_t)__stream->offset; break;
+        default: break;
+    }
+    if(__off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if((off_t)__off == __stream->offset && !(__stream->flags & __FF_MOVED)) return 0;
+    status = __stream->h.fh->SetPosition(__stream->h.fh, (uint64_t)__off);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        __stream->flags |= __FF_STALE;
+        return -1;
+    }
+    __stream->offset = (off_t)__off;
+    __stream->flags &= ~__FF_MOVED;
+    return 0;
+}
+
+static off_t __efi_tell (FILE *__stream)
+{
+    return __efi_sync(__stream) ? (off_t)-1 : __stream->offset;
+}
+
+static int __efi_eof (FILE *__stream)
+{
+    return __efi_sync(__stream) ? 1 : __stream->offset >= __stream->size;
+}
+
+static int __efi_flush (FILE *__stream)
+{
+    return !EFI_ERROR(__stream->h.fh->Flush(__stream->h.fh));
+}
+
+static int __efi_close (FILE *__stream)
+{
+    if(__stream->flags & __FF_FREEBUF)
+        free(__stream->buf);
+    return !EFI_ERROR(__stream->h.fh->Close(__stream->h.fh));
+}
+
+static int __efi_stat (FILE *__stream, struct stat *__buf)
+{
+    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
+    efi_file_info_t info;
+    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t);
+    efi_status_t status;
+    status = __stream->h.fh->GetInfo(__stream->h.fh, &infGuid, &fsiz, &info);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        return -1;
+    }
+    __stat_info(&info, __buf);
+    __stream->size = __buf->st_size;
+    return 0;
+}
+
+static const __file_ops_t __efi_ops = {
+    __efi_read, __efi_write, __efi_seek, __efi_tell, __efi_eof, __efi_flush, __efi_close, __efi_stat
+};
+
+/*** memory streams ***/
+static size_t __mem_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    if(__stream->offset >= __stream->size) return 0;
+    if(__n > __stream->size - __stream->offset) __n = __stream->size - __stream->offset;
+    memcpy(__ptr, __stream->h.mem + __stream->offset, __n);
+    __stream->offset += __n;
+    return __n;
+}
+
+static size_t __mem_write (FILE *__stream, const void *__ptr, size_t __n)
+{
+    if(__stream->flags & __FF_RDONLY) {
+        errno = EBADF;
+        return 0;
+    }
+    if(__stream->offset >= __stream->size) {
+        errno = ENOSPC;
+        return 0;
+    }
+    if(__n > __stream->size - __stream->offset) __n = __stream->size - __stream->offset;
+    memcpy(__stream->h.mem + __stream->offset, __ptr, __n);
+    __stream->offset += __n;
+    return __n;
+}
+
+static int __mem_seek (FILE *__stream, int64_t __off, int __whence)
+{
+    switch(__whence) {
+        case SEEK_END: __off += (int64_t)__stream->size; break;
+        case SEEK_CUR: __off += (int64_t)__stream->offset; break;
+        default: break;
+    }
+    if(__off < 0 || __off > (int64_t)__stream->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    __stream->offset = (off_t)__off;
+    return 0;
+}
+
+static int __mem_eof (FILE *__stream)
+{
+    return __stream->offset >= __stream->size;
+}
+
+static int __mem_close (FILE *__stream)
+{
+    if(__stream->flags & __FF_FREEBUF)
+        free(__stream->h.mem);
+    return 1;
+}
+
+static int __mem_stat (FILE *__stream, struct stat *__buf)
+{
+    __buf->st_mode = S_IREAD | (__stream->flags & __FF_RDONLY ? 0 : S_IWRITE) | S_IFREG;
+    __buf->st_size = __stream->size;
+    return 0;
+}
+
+static const __file_ops_t __mem_ops = {
+    __mem_read, __mem_write, __mem_seek, __blk_tell, __mem_eof, __con_nop, __mem_close, __mem_stat
+};
+
+/* members of mounted archives are memory streams pointing into the archive, with the member in buf */
+static int __arc_stat (FILE *__stream, struct stat *__buf)
+{
+    __archive_entry(__stream->buf, __buf);
+    return 0;
+}
+
+static const __file_ops_t __arc_ops = {
+    __mem_read, __mem_write, __mem_seek, __blk_tell, __mem_eof, __con_nop, __mem_close, __arc_stat
+};
+
+/*** stream pool, the first three are the standard streams ***/
+static wchar_t __con_buf[2][__CONBUFSIZ];
+FILE __stdio_files[FOPEN_MAX] = {
+    { &__con_ops, __FT_CON, __FF_RDONLY, { NULL }, 0, 0, NULL, 0, 0 },
+    { &__con_ops, __FT_CON, __FF_LBF, { NULL }, 0, 0, __con_buf[0], __CONBUFSIZ, 0 },
+    { &__con_ops, __FT_CON, __FF_NBF, { NULL }, 0, 0, __con_buf[1], __CONBUFSIZ, 0 }
+};
+
+static FILE *__stdio_alloc (int type, const __file_ops_t *ops)
+{
+    FILE *ret;
+    for(ret = &__stdio_files[3]; ret < &__stdio_files[FOPEN_MAX] && ret->type; ret++);
+    if(ret == &__stdio_files[FOPEN_MAX]) {
+        errno = EMFILE;
+        return NULL;
+    }
+    memset(ret, 0, sizeof(FILE));
+    ret->ops = ops;
+    ret->type = type;
+    return ret;
+}
+
+/*** gzip, zlib and raw deflate streams, decompressed as they are read ***/
+#define __GZ_GZIP   1
+#define __GZ_ZLIB   2
+#define __GZ_RAW    3
+#define __GZS_HDR       0   /* next member's header (gzip only) */
+#define __GZS_BLOCK     1   /* next block's header */
+#define __GZS_STORED    2
+#define __GZS_HUFF      3
+#define __GZS_TRAILER   4
+#define __GZS_END       5
+#define __GZWIN     32768
+#define __GZLBITS   10      /* first level lookup bits for literal / length codes */
+#define __GZDBITS   8       /* and for distance codes */
+/* worst case is every code longer than the first level having its own 2^(15 - bits) entries long subtable */
+#define __GZLTAB    ((1 << __GZLBITS) + 286 * (1 << (15 - __GZLBITS)))
+#define __GZDTAB    ((1 << __GZDBITS) + 30 * (1 << (15 - __GZDBITS)))
+typedef struct {
+    FILE *src;
+    uint64_t bits;                  /* bit buffer, filled from the lowest bit */
+    int nbits;
+    int fmt, state, last, full;     /* full: the window has been wrapped, every distance is valid */
+    uint32_t stored;                /* bytes left of a stored block */
+    uint32_t mlen, mdist;           /* match still to be copied */
+    uint32_t wpos;                  /* bytes written to the window so far */
+    uint32_t crc, isize;            /* of the current gzip member */
+    size_t inpos, inlen;
+    uint32_t lt[__GZLTAB], dt[__GZDTAB];
+    uint8_t win[__GZWIN];
+    uint8_t in[__GZBUFSIZ];
+} __gz_t;
+static const uint16_t __gz_lbase[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const uint8_t __gz_lext[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const uint16_t __gz_dbase[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,
+    4097,6145,8193,12289,16385,24577 };
+static const uint8_t __gz_dext[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+static const uint8_t __gz_clord[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+static uint32_t __gz_crctab[256];
+
+static void __gz_crc (__gz_t *z, const uint8_t *p, size_t n)
+{
+    uint32_t c, k;
+    int i;
+    if(!__gz_crctab[1])
+        for(k = 0; k < 256; k++) {
+            for(c = k, i = 0; i < 8; i++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            __gz_crctab[k] = c;
+        }
+    z->isize += (uint32_t)n;
+    for(c = ~z->crc; n; n--) c = __gz_crctab[(c ^ *p++) & 0xff] ^ (c >> 8);
+    z->crc = ~c;
+}
+
+/* top up the bit buffer, reading the next chunk of compressed data when needed */
+static void __gz_fill (__gz_t *z)
+{
+    while(z->nbits <= 56) {
+        if(z->inpos == z->inlen) {
+            z->inpos = 0;
+            if(!(z->inlen = fread(z->in, 1, __GZBUFSIZ, z->src))) return;
+        }
+        z->bits |= (uint64_t)z->in[z->inpos++] << z->nbits;
+        z->nbits += 8;
+    }
+}
+
+/* get n bits, or -1 if the input ended */
+static int32_t __gz_bits (__gz_t *z, int n)
+{
+    int32_t ret;
+    if(z->nbits < n) __gz_fill(z);
+    if(z->nbits < n) return -1;
+    ret = (int32_t)(z->bits & ((1UL << n) - 1));
+    z->bits >>= n;
+    z->nbits -= n;
+    return ret;
+}
+
+/**
+ * Build a two level lookup table from canonical Huffman code lengths. Entries are symbol << 8 | code length, or
+ * for codes longer than the first level, subtable index << 8 | 0x80 | subtable bits. Unused entries are zero.
+ */
+static int __gz_table (uint32_t *t, int tbits, const uint8_t *lens, int n)
+{
+    uint16_t cnt[16], next[16];
+    uint32_t code, rev, nt, p;
+    int i, k, l, max = 0, sub, left;
+    memset(cnt, 0, sizeof(cnt));
+    for(i = 0; i < n; i++) cnt[lens[i]]++;
+    for(l = 1, code = 0, left = 1; l < 16; l++) {
+        code = (code + (l > 1 ? cnt[l - 1] : 0)) << 1;
+        next[l] = (uint16_t)code;
+        if(cnt[l]) max = l;
+        /* over-subscribed */
+        if((left = (left << 1) - cnt[l]) < 0) return -1;
+    }
+    sub = max > tbits ? max - tbits : 0;
+    nt = 1UL << tbits;
+    memset(t, 0, nt * sizeof(uint32_t));
+    for(i = 0; i < n; i++) {
+        if(!(l = lens[i])) continue;
+        code = next[l]++;
+        /* codes are stored most significant bit first */
+        for(rev = 0, k = 0; k < l; k++) rev |= ((code >> k) & 1) << (l - 1 - k);
+        if(l <= tbits)
+            for(p = rev; p < (1UL << tbits); p += 1UL << l) t[p] = ((uint32_t)i << 8) | l;
+        else {
+            p = rev & ((1UL << tbits) - 1);
+            if(!t[p]) {
+                t[p] = (nt << 8) | 0x80 | sub;
+                memset(&t[nt], 0, (1UL << sub) * sizeof(uint32_t));
+                nt += 1UL << sub;
+            }
+            for(p = (t[p] >> 8) + (rev >> tbits), k = 0; k < (1 << (sub - (l - tbits))); k++, p += 1UL << (l - tbits))
+                t[p] = ((uint32_t)i << 8) | l;
+        }
+    }
+    return 0;
+}
+
+/* decode one symbol, or -1 on invalid code or end of input */
+static int __gz_sym (__gz_t *z, const uint32_t *t, int tbits)
+{
+    uint32_t e;
+    if(z->nbits < 15) __gz_fill(z);
+    e = t[z->bits & ((1UL << tbits) - 1)];
+    if(e & 0x80) e = t[(e >> 8) + ((z->bits >> tbits) & ((1UL << (e & 0x7f)) - 1))];
+    if(!(e & 0xff) || (int)(e & 0xff) > z->nbits) return -1;
+    z->bits >>= e & 0xff;
+    z->nbits -= e & 0xff;
+    return (int)(e >> 8);
+}
+
+static int __gz_block (__gz_t *z)
+{
+    uint8_t lens[320];
+    int32_t i, n, hlit, hdist, hclen, type, rep;
+    if((i = __gz_bits(z, 3)) < 0) return -1;
+    z->last = i & 1;
+    type = i >> 1;
+    if(!type) {
+        /* stored, the length is at the next byte boundary */
+        __gz_bits(z, z->nbits & 7);
+        if((i = __gz_bits(z, 16)) < 0 || (n = __gz_bits(z, 16)) < 0 || (i ^ n) != 0xffff) return -1;
+        z->stored = (uint32_t)i;
+        z->state = __GZS_STORED;
+        return 0;
+    }
+    if(type == 1) {
+        for(i = 0; i < 144; i++) lens[i] = 8;
+        for(; i < 256; i++) lens[i] = 9;
+        for(; i < 280; i++) lens[i] = 7;
+        for(; i < 288; i++) lens[i] = 8;
+        for(; i < 318; i++) lens[i] = 5;
+        hlit = 288; hdist = 30;
+    } else
+    if(type == 2) {
+        if((hlit = __gz_bits(z, 5)) < 0 || (hdist = __gz_bits(z, 5)) < 0 || (hclen = __gz_bits(z, 4)) < 0) return -1;
+        hlit += 257; hdist += 1; hclen += 4;
+        if(hlit > 286 || hdist > 30) return -1;
+        memset(lens, 0, 19);
+        for(i = 0; i < hclen; i++)
+            if((n = __gz_bits(z, 3)) < 0) return -1; else lens[__gz_clord[i]] = (uint8_t)n;
+        /* the code length code is at most 7 bits long, it fits in the distance table's first level */
+        if(__gz_table(z->dt, 7, lens, 19)) return -1;
+        for(i = 0; i < hlit + hdist; ) {
+            if((n = __gz_sym(z, z->dt, 7)) < 0) return -1;
+            if(n < 16) { lens[i++] = (uint8_t)n; continue; }
+            if(n == 16) {
+                if(!i || (rep = __gz_bits(z, 2)) < 0) return -1;
+                n = lens[i - 1]; rep += 3;
+            } else {
+                if((rep = __gz_bits(z, n == 17 ? 3 : 7)) < 0) return -1;
+                rep += n == 17 ? 3 : 11; n = 0;
+            }
+            if(i + rep > hlit + hdist) return -1;
+            while(rep--) lens[i++] = (uint8_t)n;
+        }
+        if(!lens[256]) return -1;
+    } else
+        return -1;
+    if(__gz_table(z->lt, __GZLBITS, lens, hlit) || __gz_table(z->dt, __GZDBITS, lens + hlit, hdist)) return -1;
+    z->state = __GZS_HUFF;
+    return 0;
+}
+
+/* gzip member header. Returns 1 if there are no more members */
+static int __gz_header (__gz_t *z)
+{
+    int32_t i, flg, n;
+    if(z->nbits < 16) __gz_fill(z);
+    if(z->nbits < 16 || (z->bits & 0xffff) != 0x8b1f) return 1;
+    if(__gz_bits(z, 16) < 0 || __gz_bits(z, 8) != 8 || (flg = __gz_bits(z, 8)) < 0) return -1;
+    /* mtime, extra flags and os */
+    for(i = 0; i < 6; i++) if(__gz_bits(z, 8) < 0) return -1;
+    if(flg & 4) {
+        if((n = __gz_bits(z, 16)) < 0) return -1;
+        while(n--) if(__gz_bits(z, 8) < 0) return -1;
+    }
+    /* file name and comment */
+    if(flg & 8) do { if((i = __gz_bits(z, 8)) < 0) return -1; } while(i);
+    if(flg & 16) do { if((i = __gz_bits(z, 8)) < 0) return -1; } while(i);
+    if((flg & 2) && __gz_bits(z, 16) < 0) return -1;
+    z->crc = z->isize = 0;
+    z->state = __GZS_BLOCK;
+    return 0;
+}
+
+static size_t __gz_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    __gz_t *z = (__gz_t*)__stream->h.ptr;
+    uint8_t *out = (uint8_t*)__ptr, *end = out + __n, *chk = out, c;
+    int32_t sym, x;
+    uint32_t k, s, len;
+    while(out < end) {
+        if(z->mlen) {
+            k = (size_t)(end - out) < z->mlen ? (uint32_t)(end - out) : z->mlen;
+            z->mlen -= k;
+            for(s = z->wpos - z->mdist; k; k--) {
+                c = z->win[s++ & (__GZWIN - 1)];
+                z->win[z->wpos++ & (__GZWIN - 1)] = c;
+                *out++ = c;
+            }
+            continue;
+        }
+        switch(z->state) {
+            case __GZS_HDR:
+                if((sym = __gz_header(z)) < 0) goto err;
+                if(sym) z->state = __GZS_END;
+            break;
+            case __GZS_BLOCK:
+                if(__gz_block(z)) goto err;
+            break;
+            case __GZS_STORED:
+                for(; z->stored && out < end && z->nbits >= 8; z->stored--) {
+                    c = (uint8_t)z->bits;
+                    z->bits >>= 8; z->nbits -= 8;
+                    z->win[z->wpos++ & (__GZWIN - 1)] = c;
+                    *out++ = c;
+                }
+                while(z->stored && out < end) {
+                    if(z->inpos == z->inlen) {
+                        z->inpos = 0;
+                        if(!(z->inlen = fread(z->in, 1, __GZBUFSIZ, z->src))) goto err;
+                    }
+                    k = (uint32_t)(z->inlen - z->inpos);
+                    if(k > z->stored) k = z->stored;
+                    if(k > (size_t)(end - out)) k = (uint32_t)(end - out);
+                    memcpy(out, z->in + z->inpos, k);
+                    z->inpos += k; z->stored -= k;
+                    for(; k; k--) z->win[z->wpos++ & (__GZWIN - 1)] = *out++;
+                }
+                if(!z->stored) z->state = z->last ? __GZS_TRAILER : __GZS_BLOCK;
+            break;
+            case __GZS_HUFF:
+                while(out < end) {
+                    if((sym = __gz_sym(z, z->lt, __GZLBITS)) < 0) goto err;
+                    if(sym < 256) {
+                        z->win[z->wpos++ & (__GZWIN - 1)] = (uint8_t)sym;
+                        *out++ = (uint8_t)sym;
+                        continue;
+                    }
+                    if(sym == 256) {
+                        z->state = z->last ? __GZS_TRAILER : __GZS_BLOCK;
+                        break;
+                    }
+                    if((sym -= 257) >= 29) goto err;
+                    if((x = __gz_bits(z, __gz_lext[sym])) < 0) goto err;
+                    len = __gz_lbase[sym] + (uint32_t)x;
+                    if((sym = __gz_sym(z, z->dt, __GZDBITS)) < 0 || sym >= 30 || (x = __gz_bits(z, __gz_dext[sym])) < 0) goto err;
+                    z->mdist = __gz_dbase[sym] + (uint32_t)x;
+                    if(z->wpos >= __GZWIN) z->full = 1;
+                    if(!z->full && z->mdist > z->wpos) goto err;
+                    z->mlen = len;
+                    break;
+                }
+            break;
+            case __GZS_TRAILER:
+                __gz_bits(z, z->nbits & 7);
+                if(z->fmt == __GZ_GZIP) {
+                    __gz_crc(z, chk, (size_t)(out - chk));
+                    chk = out;
+                    if((uint32_t)__gz_bits(z, 16) != (z->crc & 0xffff) || (uint32_t)__gz_bits(z, 16) != (z->crc >> 16) ||
+                        (uint32_t)__gz_bits(z, 16) != (z->isize & 0xffff) || (uint32_t)__gz_bits(z, 16) != (z->isize >> 16))
+                            goto err;
+                    /* concatenated members are decompressed as one stream */
+                    z->state = __GZS_HDR;
+                } else {
+                    /* the adler32 checksum isn't verified */
+                    if(z->fmt == __GZ_ZLIB && __gz_bits(z, 16) >= 0) __gz_bits(z, 16);
+                    z->state = __GZS_END;
+                }
+            break;
+            default: goto done;
+        }
+    }
+done:
+    if(z->fmt == __GZ_GZIP) __gz_crc(z, chk, (size_t)(out - chk));
+    __stream->offset += (off_t)(out - (uint8_t*)__ptr);
+    return (size_t)(out - (uint8_t*)__ptr);
+err:
+    errno = EIO;
+    z->state = __GZS_END;
+    z->mlen = 0;
+    goto done;
+}
+
+static size_t __gz_write (FILE *__stream, const void *__ptr, size_t __n)
+{
+    (void)__stream; (void)__ptr; (void)__n;
+    errno = EBADF;
+    return 0;
+}
+
+/* detect the format and reset the decoder, the source must be at the beginning */
+static int __gz_start (__gz_t *z, int force)
+{
+    uint32_t h;
+    z->bits = 0; z->nbits = 0; z->inpos = z->inlen = 0;
+    z->last = z->full = 0; z->mlen = z->stored = z->wpos = 0;
+    __gz_fill(z);
+    h = (uint32_t)z->bits & 0xffff;
+    if(z->nbits >= 16 && h == 0x8b1f) {
+        z->fmt = __GZ_GZIP;
+        return __gz_header(z) ? -1 : 0;
+    }
+    if(!force) return 1;
+    if(z->nbits >= 16 && (h & 0x208f) == 8 && !(((h & 0xff) << 8 | h >> 8) % 31)) {
+        z->fmt = __GZ_ZLIB;
+        __gz_bits(z, 16);
+    } else
+        z->fmt = __GZ_RAW;
+    z->state = __GZS_BLOCK;
+    return 0;
+}
+
+/* only forward seeks are cheap, backwards means decompressing again from the start */
+static int __unz_seek (FILE *__stream, int64_t __off, int __whence, int (*rewind)(FILE *__stream))
+{
+    uint8_t tmp[512];
+    size_t n;
+    if(__whence == SEEK_END && !__stream->size) {
+        while(__stream->ops->read(__stream, tmp, sizeof(tmp)));
+        __stream->size = __stream->offset;
+    }
+    switch(__whence) {
+        case SEEK_END: __off += (int64_t)__stream->size; break;
+        case SEEK_CUR: __off += (int64_t)__stream->offset; break;
+        default: break;
+    }
+    if(__off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if((off_t)__off < __stream->offset) {
+        if(rewind(__stream)) {
+            errno = ESPIPE;
+            return -1;
+        }
+        __stream->offset = 0;
+    }
+    while(__stream->offset < (off_t)__off) {
+        n = (off_t)__off - __stream->offset < sizeof(tmp) ? (size_t)((off_t)__off - __stream->offset) : sizeof(tmp);
+        if(!__stream->ops->read(__stream, tmp, n)) break;
+    }
+    return 0;
+}
+
+static int __gz_rewind (FILE *__stream)
+{
+    __gz_t *z = (__gz_t*)__stream->h.ptr;
+    return fseek(z->src, 0, SEEK_SET) || __gz_start(z, 1);
+}
+
+static int __gz_seek (FILE *__stream, int64_t __off, int __whence)
+{
+    return __unz_seek(__stream, __off, __whence, __gz_rewind);
+}
+
+static int __gz_eof (FILE *__stream)
+{
+    __gz_t *z = (__gz_t*)__stream->h.ptr;
+    return z->state == __GZS_END && !z->mlen;
+}
+
+static int __gz_close (FILE *__stream)
+{
+    __gz_t *z = (__gz_t*)__stream->h.ptr;
+    fclose(z->src);
+    free(z);
+    return 1;
+}
+
+static int __gz_stat (FILE *__stream, struct stat *__buf)
+{
+    __gz_t *z = (__gz_t*)__stream->h.ptr;
+    if(z->src->ops->stat(z->src, __buf)) return -1;
+    __buf->st_mode &= ~S_IWRITE;
+    __buf->st_size = __stream->size;
+    return 0;
+}
+
+static const __file_ops_t __gz_ops = {
+    __gz_read, __gz_write, __gz_seek, __blk_tell, __gz_eof, __con_nop, __gz_close, __gz_stat
+};
+
+/* LZ4 frames, the decoder is in lz4.c */
+static size_t __lz4s_read (FILE *__stream, void *__ptr, size_t __n)
+{
+    __n = __lz4_read(__stream->h.ptr, __ptr, __n);
+    __stream->offset += (off_t)__n;
+    return __n;
+}
+
+static int __lz4s_rewind (FILE *__stream)
+{
+    return __lz4_reset(__stream->h.ptr);
+}
+
+static int __lz4s_seek (FILE *__stream, int64_t __off, int __whence)
+{
+    return __unz_seek(__stream, __off, __whence, __lz4s_rewind);
+}
+
+static int __lz4s_eof (FILE *__stream)
+{
+    return __lz4_eof(__stream->h.ptr);
+}
+
+static int __lz4s_close (FILE *__stream)
+{
+    __lz4_close(__stream->h.ptr);
+    return 1;
+}
+
+static int __lz4s_stat (FILE *__stream, struct stat *__buf)
+{
+    __buf->st_mode = S_IREAD | S_IFREG;
+    __buf->st_size = __stream->size;
+    return 0;
+}
+
+static const __file_ops_t __lz4s_ops = {
+    __lz4s_read, __gz_write, __lz4s_seek, __blk_tell, __lz4s_eof, __con_nop, __lz4s_close, __lz4s_stat
+};
+
+/**
+ * Put a decompressing stream on top of src. With mode 2 (force) the format is detected, otherwise only the one
+ * the suffix says is recognized, and src itself is returned for anything else. The uncompressed size is taken from
+ * the LZ4 frame header, or from the last four bytes of gzip files (modulo 4G, of the last member).
+ */
+static FILE *__gz_open (FILE *src, int mode)
+{
+    FILE *ret;
+    __gz_t *z;
+    void *l;
+    uint8_t isize[4];
+    off_t size = 0;
+    int r;
+    if(mode >= 2 && (l = __lz4_open(src, &size))) {
+        if(!(ret = __stdio_alloc(__FT_GZ, &__lz4s_ops))) { __lz4_close(l); return NULL; }
+        ret->h.ptr = l;
+        ret->flags = __FF_RDONLY;
+        ret->size = size;
+        return ret;
+    }
+    if(mode == 3) return src;
+    if(!(z = (__gz_t*)malloc(sizeof(__gz_t)))) { fclose(src); return NULL; }
+    memset(z, 0, sizeof(__gz_t) - sizeof(z->win) - sizeof(z->in));
+    z->src = src;
+    if((r = __gz_start(z, mode == 2))) {
+        free(z);
+        if(r > 0 && !fseek(src, 0, SEEK_SET)) return src;
+        fclose(src);
+        errno = EIO;
+        return NULL;
+    }
+    if(!(ret = __stdio_alloc(__FT_GZ, &__gz_ops))) { free(z); fclose(src); return NULL; }
+    ret->h.ptr = z;
+    ret->flags = __FF_RDONLY;
+    if(z->fmt == __GZ_GZIP && src->size > 18 && pread(src, isize, 4, src->size - 4) == 4)
+        ret->size = (off_t)isize[0] | (off_t)isize[1] << 8 | (off_t)isize[2] << 16 | (off_t)isize[3] << 24;
+    return ret;
+}
+
+/* "rz" always decompresses (2), "r" only gzip files with a .gz (1) and LZ4 frames with a .lz4 suffix (3) */
+static int __gz_mode (const wchar_t *wcname, const char_t *__modes)
+{
+    size_t l;
+    if(__modes[0] != CL('r')) return 0;
+    if(__modes[1] == CL('z')) return 2;
+    if(__modes[1]) return 0;
+    for(l = 0; wcname[l]; l++);
+    if(l > 4 && wcname[l - 4] == L'.' && (wcname[l - 3] | 32) == L'l' && (wcname[l - 2] | 32) == L'z' && wcname[l - 1] == L'4')
+        return 3;
+    return l > 3 && wcname[l - 3] == L'.' && (wcname[l - 2] | 32) == L'g' && (wcname[l - 1] | 32) == L'z';
+}
+
+/**
+ * Transcode a path for the firmware into a static scratch buffer, which is reused by every call. In the same pass
+ * separators are converted to backslashes (the only ones UEFI accepts) and collapsed, and "." and ".." are resolved.
+ * Leading ".." components of relative paths are kept, those refer to the parent of the starting directory.
+ */
+static wchar_t __stdio_wcname[__PATHMAX];
+wchar_t *__stdio_wpath (const char_t *__path)
+{
+    wchar_t *out = __stdio_wcname;
+    size_t n = 0, base, start, comp, prev;
+    int len;
+    if(*__path == CL('/') || *__path == CL('\\')) out[n++] = L'\\';
+    base = n;
+    while(*__path) {
+        if(*__path == CL('/') || *__path == CL('\\')) { __path++; continue; }
+        start = n;
+        if(n > base) out[n++] = L'\\';
+        comp = n;
+        while(*__path && *__path != CL('/') && *__path != CL('\\')) {
+            if(n >= __PATHMAX - 1) {
+                errno = ENAMETOOLONG;
+                return NULL;
+            }
+#if USE_UTF8
+            if((len = mbtowc(&out[n], __path, 4)) < 1) {
+                errno = EINVAL;
+                return NULL;
+            }
+            __path += len;
+#else
+            out[n] = *__path++;
+            (void)len;
+#endif
+            n++;
+        }
+        if(n - comp == 1 && out[comp] == L'.') n = start;
+        else if(n - comp == 2 && out[comp] == L'.' && out[comp + 1] == L'.') {
+            for(prev = start; prev > base && out[prev - 1] != L'\\'; prev--);
+            /* drop the previous component, unless it's a ".." that couldn't be resolved either */
+            if(start > base && !(start - prev == 2 && out[prev] == L'.' && out[prev + 1] == L'.'))
+                n = prev > base ? prev - 1 : base;
+            else if(base) n = start;
+        }
+    }
+    if(!n) out[n++] = L'.';
+    out[n] = 0;
+    return out;
+}
+
+/*** directory handle cache, least recently used entry gets replaced ***/
+typedef struct {
+    efi_file_handle_t *root;        /* volume, NULL if the slot is free */
+    efi_file_handle_t *fh;
+    uint32_t used;
+    wchar_t path[__DIRCACHEPATH];
+} __dircache_t;
+static __dircache_t __dircache[__DIRCACHE];
+static uint32_t __dircache_clk = 0;
+
+static int __dircache_cmp (const wchar_t *a, const wchar_t *b)
+{
+    wchar_t x, y;
+    do {
+        x = *a++; y = *b++;
+        if(x >= L'a' && x <= L'z') x -= 32;
+        if(y >= L'a' && y <= L'z') y -= 32;
+    } while(x && x == y);
+    return x != y;
+}
+
+static efi_file_handle_t *__dircache_get (efi_file_handle_t *root, wchar_t *path)
+{
+    __dircache_t *c, *lru = &__dircache[0];
+    efi_file_handle_t *fh;
+    size_t len;
+    for(len = 0; path[len]; len++);
+    if(len >= __DIRCACHEPATH) return NULL;
+    for(c = __dircache; c < &__dircache[__DIRCACHE]; c++) {
+        if(c->root == root && !__dircache_cmp(c->path, path)) {
+            c->used = ++__dircache_clk;
+            return c->fh;
+        }
+        if(!c->root || (lru->root && c->used < lru->used)) lru = c;
+    }
+    if(EFI_ERROR(root->Open(root, &fh, path, EFI_FILE_MODE_READ, 0))) return NULL;
+    if(lru->root) lru->fh->Close(lru->fh);
+    lru->root = root;
+    lru->fh = fh;
+    lru->used = ++__dircache_clk;
+    memcpy(lru->path, path, (len + 1) * sizeof(wchar_t));
+    return fh;
+}
+
+/* cached handles would keep deleted directories alive */
+static void __dircache_flush (void)
+{
+    __dircache_t *c;
+    for(c = __dircache; c < &__dircache[__DIRCACHE]; c++)
+        if(c->root) {
+            c->fh->Close(c->fh);
+            c->root = NULL;
+        }
+}
+
+static FILE *__efi_open (efi_file_handle_t *dir, wchar_t *wcname, const char_t *__modes)
+{
+    FILE *ret;
+    efi_status_t status;
+    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
+    efi_file_info_t info;
+    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t);
+    if(!(ret = __stdio_alloc(__FT_FILE, &__efi_ops))) return NULL;
+    errno = 0;
+    status = dir->Open(dir, &ret->h.fh, wcname,
+        __modes[0] == CL('w') || __modes[0] == CL('a') ? (EFI_FILE_MODE_WRITE | EFI_FILE_MODE_READ | EFI_FILE_MODE_CREATE) :
+        (__modes[1] == CL('+') ? EFI_FILE_MODE_WRITE | EFI_FILE_MODE_READ : EFI_FILE_MODE_READ),
+        __modes[1] == CL('d') ? EFI_FILE_DIRECTORY : 0);
+    if(EFI_ERROR(status)) {
+err:    __stdio_seterrno(status);
+        ret->type = 0; return NULL;
+    }
+    status = ret->h.fh->GetInfo(ret->h.fh, &infGuid, &fsiz, &info);
+    if(EFI_ERROR(status)) { ret->h.fh->Close(ret->h.fh); goto err; }
+    if(__modes[1] == CL('d') && !(info.Attribute & EFI_FILE_DIRECTORY)) {
+        fclose(ret); errno = ENOTDIR; return NULL;
+    }
+    /* "*" is used internally by stat and remove, it opens anything */
+    if(__modes[0] != CL('*') && __modes[1] != CL('d') && (info.Attribute & EFI_FILE_DIRECTORY)) {
+        fclose(ret); errno = EISDIR; return NULL;
+    }
+    if(__modes[0] == CL('w') && __modes[1] != CL('d') && info.FileSize) {
+        info.FileSize = 0;
+        status = ret->h.fh->SetInfo(ret->h.fh, &infGuid, fsiz, &info);
+        if(EFI_ERROR(status)) { ret->h.fh->Close(ret->h.fh); goto err; }
+    }
+    ret->size = (off_t)info.FileSize;
+    if(__modes[0] == CL('a')) fseek(ret, 0, SEEK_END);
+    return ret;
+}
 
 void __stdio_cleanup()
 {
+    FILE *f;
+    uintn_t i;
+    fflush(stdout);
+    fflush(stderr);
+    /* the ring is kept for stdio_tee_log */
+    __tee_stop();
 #if USE_UTF8
     if(__argvutf8)
         BS->FreePool(__argvutf8);
 #endif
+    /* directly driven UARTs don't need the firmware, they remain usable after exit_bs */
+    for(f = &__stdio_files[3]; f < &__stdio_files[FOPEN_MAX]; f++)
+        if(f->type && f->ops != &__uart_ops)
+            fclose(f);
     if(__blk_devs) {
         free(__blk_devs);
         __blk_devs = NULL;
+        __blk_devs2 = NULL;
         __blk_ndevs = 0;
     }
-}
-
-void __stdio_seterrno(efi_status_t status)
-{
-    switch((int)(status & 0xffff)) {
-        case EFI_WRITE_PROTECTED & 0xffff: errno = EROFS; break;
-        case EFI_ACCESS_DENIED & 0xffff: errno = EACCES; break;
-        case EFI_VOLUME_FULL & 0xffff: errno = ENOSPC; break;
-        case EFI_NOT_FOUND & 0xffff: errno = ENOENT; break;
-        case EFI_INVALID_PARAMETER & 0xffff: errno = EINVAL; break;
-        default: errno = EIO; break;
+    __dircache_flush();
+    __tmpfs_cleanup();
+    __archive_cleanup();
+    if(__vol_handles) {
+        for(i = 0; __vol_roots && i < __vol_n; i++)
+            if(__vol_roots[i] && __vol_roots[i] != __root_dir)
+                __vol_roots[i]->Close(__vol_roots[i]);
+        free(__vol_roots);
+        BS->FreePool(__vol_handles);
+        __vol_handles = NULL;
+        __vol_roots = NULL;
+        __vol_n = 0;
     }
 }
 
-int fstat (FILE *__f, struct stat *__buf)
+/**
+ * Strip the "fsN:" or "/vol/N" prefix from path and return that volume's root directory. "/tmp" is the in-memory one
+ */
+static efi_file_handle_t *__stdio_volume (const char_t **__path)
 {
-    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
-    efi_file_info_t info;
-    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t);
     efi_status_t status;
-    int i;
-
-    if(!__f || !__buf) {
-        errno = EINVAL;
-        return -1;
+    efi_guid_t sfsGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    efi_simple_file_system_protocol_t *sfs = NULL;
+    const char_t *p = *__path;
+    uintn_t n = 0;
+    if(!memcmp(p, CL("/tmp"), 4 * sizeof(char_t)) && (!p[4] || p[4] == CL('/') || p[4] == CL('\\'))) {
+        *__path = p[4] ? p + 4 : CL("\\");
+        return __tmpfs_root();
     }
-    memset(__buf, 0, sizeof(struct stat));
-    if(__f == stdin) {
-        __buf->st_mode = S_IREAD | S_IFIFO;
-        return 0;
+    if((p[0] == CL('f') || p[0] == CL('F')) && (p[1] == CL('s') || p[1] == CL('S')) && p[2] >= CL('0') && p[2] <= CL('9')) {
+        for(p += 2; *p >= CL('0') && *p <= CL('9'); p++) n = n * 10 + *p - CL('0');
+        if(*p != CL(':')) goto boot;
+        p++;
+    } else
+    if(!memcmp(p, CL("/vol/"), 5 * sizeof(char_t)) && p[5] >= CL('0') && p[5] <= CL('9')) {
+        for(p += 5; *p >= CL('0') && *p <= CL('9'); p++) n = n * 10 + *p - CL('0');
+        if(*p && *p != CL('/') && *p != CL('\\')) goto boot;
+    } else {
+boot:   if(!__root_dir && LIP) {
+            status = BS->HandleProtocol(LIP->DeviceHandle, &sfsGuid, (void **)&sfs);
+            if(!EFI_ERROR(status))
+                status = sfs->OpenVolume(sfs, &__root_dir);
+        }
+        if(!__root_dir) errno = ENODEV;
+        return __root_dir;
     }
-    if(__f == stdout || __f == stderr) {
-        __buf->st_mode = S_IWRITE | S_IFIFO;
-        return 0;
+    /* the volume root itself */
+    *__path = *p ? p : CL("\\");
+    if(!__vol_handles) {
+        status = BS->LocateHandleBuffer(ByProtocol, &sfsGuid, NULL, &__vol_n, &__vol_handles);
+        if(EFI_ERROR(status) || !__vol_n) {
+            __vol_handles = NULL; __vol_n = 0;
+            errno = ENODEV;
+            return NULL;
+        }
+        __vol_roots = (efi_file_handle_t**)malloc(__vol_n * sizeof(efi_file_handle_t*));
+        if(!__vol_roots) {
+            BS->FreePool(__vol_handles);
+            __vol_handles = NULL; __vol_n = 0;
+            return NULL;
+        }
+        memset(__vol_roots, 0, __vol_n * sizeof(efi_file_handle_t*));
     }
-    if(__ser && __f == (FILE*)__ser) {
-        __buf->st_mode = S_IREAD | S_IWRITE | S_IFCHR;
-        return 0;
+    if(n >= __vol_n) {
+        errno = ENODEV;
+        return NULL;
     }
-    for(i = 0; i < __blk_ndevs; i++)
-        if(__f == (FILE*)__blk_devs[i].bio) {
-            __buf->st_mode = S_IREAD | S_IWRITE | S_IFBLK;
-            __buf->st_size = (off_t)__blk_devs[i].bio->Media->BlockSize * (off_t)__blk_devs[i].bio->Media->LastBlock;
-            __buf->st_blocks = __blk_devs[i].bio->Media->LastBlock;
-            return 0;
+    if(!__vol_roots[n]) {
+        status = BS->HandleProtocol(__vol_handles[n], &sfsGuid, (void **)&sfs);
+        if(!EFI_ERROR(status))
+            status = sfs->OpenVolume(sfs, &__vol_roots[n]);
+        if(EFI_ERROR(status) || !__vol_roots[n]) {
+            __vol_roots[n] = NULL;
+            errno = ENODEV;
+            return NULL;
         }
-    status = __f->GetInfo(__f, &infGuid, &fsiz, &info);
-    if(EFI_ERROR(status)) {
-        __stdio_seterrno(status);
+    }
+    return __vol_roots[n];
+}
+
+int fstat (FILE *__f, struct stat *__buf)
+{
+    if(!__f || !__f->type || !__buf) {
+        errno = EINVAL;
         return -1;
     }
-    __buf->st_mode = S_IREAD |
-        (info.Attribute & EFI_FILE_READ_ONLY ? 0 : S_IWRITE) |
-        (info.Attribute & EFI_FILE_DIRECTORY ? S_IFDIR : S_IFREG);
-    __buf->st_size = (off_t)info.FileSize;
-    __buf->st_blocks = (blkcnt_t)info.PhysicalSize;
-    __buf->st_atime = __mktime_efi(&info.LastAccessTime);
-    __buf->st_mtime = __mktime_efi(&info.ModificationTime);
-    __buf->st_ctime = __mktime_efi(&info.CreateTime);
-    return 0;
+    memset(__buf, 0, sizeof(struct stat));
+    return __f->ops->stat(__f, __buf);
 }
 
 int fclose (FILE *__stream)
 {
-    efi_status_t status = EFI_SUCCESS;
-    uintn_t i;
-    if(__stream == stdin || __stream == stdout || __stream == stderr || (__ser && __stream == (FILE*)__ser)) {
-        return 1;
+    int ret;
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return 0;
     }
-    for(i = 0; i < __blk_ndevs; i++)
-        if(__stream == (FILE*)__blk_devs[i].bio)
-            return 1;
-    status = __stream->Close(__stream);
-    free(__stream);
-    return !EFI_ERROR(status);
+    if(__stream->type == __FT_CON)
+        return __stream->ops->flush(__stream);
+    ret = __stream->ops->close(__stream);
+    __stream->type = 0;
+    return ret;
 }
 
 int fflush (FILE *__stream)
 {
-    efi_status_t status = EFI_SUCCESS;
-    uintn_t i;
-    if(__stream == stdin || __stream == stdout || __stream == stderr || (__ser && __stream == (FILE*)__ser)) {
-        return 1;
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return 0;
     }
-    for(i = 0; i < __blk_ndevs; i++)
-        if(__stream == (FILE*)__blk_devs[i].bio) {
-            return 1;
-        }
-    status = __stream->Flush(__stream);
-    return !EFI_ERROR(status);
+    return __stream->ops->flush(__stream);
 }
 
 int __remove (const char_t *__filename, int isdir)
@@ -144,37 +1665,55 @@ int __remove (const char_t *__filename, int isdir)
     efi_status_t status;
     efi_guid_t infGuid = EFI_FILE_INFO_GUID;
     efi_file_info_t info;
-    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t), i;
-    FILE *f = fopen(__filename, CL("r"));
-    if(f == stdin || f == stdout || f == stderr || (__ser && f == (FILE*)__ser)) {
+    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t);
+    DIR *d;
+    struct dirent *de;
+    int full = 0;
+    /* the firmware only deletes through a handle that was opened for writing, so a write protected volume
+     * or a read-only file fails here already */
+    FILE *f = fopen(__filename, CL("*+"));
+    if(!f) return -1;
+    if(f->ops == &__arc_ops) {
+        fclose(f);
+        errno = EROFS;
+        return -1;
+    }
+    if(f->type != __FT_FILE) {
+        fclose(f);
         errno = EBADF;
         return 1;
     }
-    for(i = 0; i < __blk_ndevs; i++)
-        if(f == (FILE*)__blk_devs[i].bio) {
-            errno = EBADF;
-            return 1;
-        }
-    if(isdir != -1) {
-        status = f->GetInfo(f, &infGuid, &fsiz, &info);
-        if(EFI_ERROR(status)) goto err;
-        if(isdir == 0 && (info.Attribute & EFI_FILE_DIRECTORY)) {
-            fclose(f); errno = EISDIR;
-            return -1;
-        }
-        if(isdir == 1 && !(info.Attribute & EFI_FILE_DIRECTORY)) {
-            fclose(f); errno = ENOTDIR;
-            return -1;
+    status = f->h.fh->GetInfo(f->h.fh, &infGuid, &fsiz, &info);
+    if(EFI_ERROR(status)) goto err;
+    if(isdir == 0 && (info.Attribute & EFI_FILE_DIRECTORY)) {
+        fclose(f); errno = EISDIR;
+        return -1;
+    }
+    if(isdir == 1 && !(info.Attribute & EFI_FILE_DIRECTORY)) {
+        fclose(f); errno = ENOTDIR;
+        return -1;
+    }
+    __dircache_flush();
+    status = f->h.fh->Delete(f->h.fh);
+    if(status == EFI_WARN_DELETE_FAILURE) {
+        /* not an error for the firmware, but the handle is closed and the file is still there. Only a
+         * directory with entries in it is ENOTEMPTY, anything else was refused by the driver */
+        f->type = 0;
+        if((info.Attribute & EFI_FILE_DIRECTORY) && (d = opendir(__filename))) {
+            while(!full && (de = readdir(d)))
+                full = strcmp(de->d_name, CL(".")) && strcmp(de->d_name, CL(".."));
+            closedir(d);
         }
+        errno = full ? ENOTEMPTY : EIO;
+        return -1;
     }
-    status = f->Delete(f);
     if(EFI_ERROR(status)) {
 err:    __stdio_seterrno(status);
         fclose(f);
         return -1;
     }
-    /* no need for fclose(f); */
-    free(f);
+    /* no need for fclose(f), Delete has closed the handle */
+    f->type = 0;
     return 0;
 }
 
@@ -186,19 +1725,37 @@ int remove (const char_t *__filename)
 FILE *fopen (const char_t *__filename, const char_t *__modes)
 {
     FILE *ret;
+    efi_file_handle_t *root, *dir = NULL;
     efi_status_t status;
-    efi_guid_t sfsGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
-    efi_simple_file_system_protocol_t *sfs = NULL;
-    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
-    efi_file_info_t info;
-    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t), par, i;
-#if USE_UTF8
-    wchar_t wcname[BUFSIZ];
-#endif
+    uintn_t par, i;
+    wchar_t *wcname, *wc, *leaf;
+    struct stat st;
+    void *ent;
+    int gz;
     if(!__filename || !*__filename || !__modes || !*__modes) {
         errno = EINVAL;
         return NULL;
     }
+    /* members of mounted archives are read in place, straight from memory */
+    if((gz = __archive_find(__filename, &ent)) >= 0) {
+        if(!gz) return NULL;
+        if((__modes[0] != CL('r') && __modes[0] != CL('*')) || __modes[1] == CL('+')) {
+            errno = EROFS;
+            return NULL;
+        }
+        if(!(ret = __stdio_alloc(__FT_MEM, &__arc_ops))) return NULL;
+        ret->h.mem = __archive_entry(ent, &st);
+        ret->size = st.st_size;
+        ret->flags = __FF_RDONLY;
+        ret->buf = ent;
+        if(S_ISDIR(st.st_mode) && __modes[0] != CL('*')) {
+            ret->type = 0;
+            errno = EISDIR;
+            return NULL;
+        }
+        gz = (wcname = __stdio_wpath(__filename)) ? __gz_mode(wcname, __modes) : 0;
+        return gz ? __gz_open(ret, gz) : ret;
+    }
     /* fake some device names. UEFI has no concept of device files */
     if(!strcmp(__filename, CL("/dev/stdin"))) {
         if(__modes[0] == CL('w') || __modes[0] == CL('a')) { errno = EPERM; return NULL; }
@@ -213,370 +1770,1140 @@ FILE *fopen (const char_t *__filename, const char_t *__modes)
         return stderr;
     }
     if(!memcmp(__filename, CL("/dev/serial"), 11 * sizeof(char_t))) {
-        par = atol(__filename + 11);
-        if(!__ser) {
-            efi_guid_t serGuid = EFI_SERIAL_IO_PROTOCOL_GUID;
-            status = BS->LocateProtocol(&serGuid, NULL, (void**)&__ser);
-            if(EFI_ERROR(status) || !__ser) { errno = ENOENT; return NULL; }
+        /* "/dev/serial[baud][,fifo=depth][,timeout=usec][,nonblock][,uart]" */
+        const char_t *p = __filename + 11;
+        uint32_t fifo = 0, tmo = 0;
+        int nb = 0, uart = 0;
+        for(par = 0; *p >= CL('0') && *p <= CL('9'); p++) par = par * 10 + *p - CL('0');
+        for(; *p == CL(','); ) {
+            p++;
+            if(!strncmp(p, CL("fifo="), 5)) fifo = (uint32_t)atol(p + 5); else
+            if(!strncmp(p, CL("timeout="), 8)) tmo = (uint32_t)atol(p + 8); else
+            if(!strncmp(p, CL("nonblock"), 8)) nb = 1; else
+            if(!strncmp(p, CL("uart"), 4)) uart = 1; else
+                break;
+            while(*p && *p != CL(',')) p++;
+        }
+        if(*p) { errno = EINVAL; return NULL; }
+        if(uart) {
+            if(!__uart_init() || !(ret = __stdio_alloc(__FT_SER, &__uart_ops))) return NULL;
+            __uart_baud(par > 9600 ? par : 115200);
+            if(nb) ret->flags |= __FF_NONBLOCK;
+            return ret;
         }
-        __ser->SetAttributes(__ser, par > 9600 ? par : 115200, 0, 1000, NoParity, 8, OneStopBit);
-        return (FILE*)__ser;
+        if(!__ser_init(par > 9600 ? par : 115200, fifo, tmo)) return NULL;
+        if(!(ret = __stdio_alloc(__FT_SER, &__ser_ops))) return NULL;
+        ret->h.ser = __ser;
+        if(nb) ret->flags |= __FF_NONBLOCK;
+        /* without memory for the receive ring every read goes to the firmware */
+        if((ret->buf = malloc(__SERBUFSIZ))) {
+            ret->bufsiz = __SERBUFSIZ;
+            ret->flags |= __FF_FREEBUF;
+        }
+        return ret;
     }
     if(!memcmp(__filename, CL("/dev/disk"), 9 * sizeof(char_t))) {
         par = atol(__filename + 9);
         if(!__blk_ndevs) {
-            efi_guid_t bioGuid = EFI_BLOCK_IO_PROTOCOL_GUID;
+            efi_guid_t bioGuid = EFI_BLOCK_IO_PROTOCOL_GUID, bio2Guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
             efi_handle_t handles[128];
             uintn_t handle_size = sizeof(handles);
-            status = BS->LocateHandle(ByProtocol, &bioGuid, NULL, handle_size, (efi_handle_t*)&handles);
+            status = BS->LocateHandle(ByProtocol, &bioGuid, NULL, &handle_size, (efi_handle_t*)&handles);
             if(!EFI_ERROR(status)) {
                 handle_size /= (uintn_t)sizeof(efi_handle_t);
-                __blk_devs = (block_file_t*)malloc(handle_size * sizeof(block_file_t));
+                /* Block IO 2 interfaces, if any, are stored after the Block IO ones */
+                __blk_devs = (efi_block_io_t**)malloc(handle_size * 2 * sizeof(efi_block_io_t*));
                 if(__blk_devs) {
-                    memset(__blk_devs, 0, handle_size * sizeof(block_file_t));
+                    memset(__blk_devs, 0, handle_size * 2 * sizeof(efi_block_io_t*));
+                    __blk_devs2 = (efi_block_io2_t**)&__blk_devs[handle_size];
                     for(i = __blk_ndevs = 0; i < handle_size; i++)
-                        if(!EFI_ERROR(BS->HandleProtocol(handles[i], &bioGuid, (void **) &__blk_devs[__blk_ndevs].bio)) &&
-                            __blk_devs[__blk_ndevs].bio && __blk_devs[__blk_ndevs].bio->Media &&
-                            __blk_devs[__blk_ndevs].bio->Media->BlockSize > 0)
+                        if(!EFI_ERROR(BS->HandleProtocol(handles[i], &bioGuid, (void **) &__blk_devs[__blk_ndevs])) &&
+                            __blk_devs[__blk_ndevs] && __blk_devs[__blk_ndevs]->Media &&
+                            __blk_devs[__blk_ndevs]->Media->BlockSize > 0) {
+                                if(EFI_ERROR(BS->HandleProtocol(handles[i], &bio2Guid, (void **) &__blk_devs2[__blk_ndevs])))
+                                    __blk_devs2[__blk_ndevs] = NULL;
                                 __blk_ndevs++;
+                            }
                 } else
                     __blk_ndevs = 0;
             }
         }
-        if(__blk_ndevs && par >= 0 && par < __blk_ndevs)
-            return (FILE*)__blk_devs[par].bio;
+        if(__blk_ndevs && par < __blk_ndevs) {
+            if(!(ret = __stdio_alloc(__FT_BLK, &__blk_ops))) return NULL;
+            ret->h.bio = __blk_devs[par];
+            return ret;
+        }
         errno = ENOENT;
         return NULL;
     }
-    if(!__root_dir && LIP) {
-        status = BS->HandleProtocol(LIP->DeviceHandle, &sfsGuid, (void **)&sfs);
-        if(!EFI_ERROR(status))
-            status = sfs->OpenVolume(sfs, &__root_dir);
+    if(!(root = __stdio_volume(&__filename)) || !(wcname = __stdio_wpath(__filename))) return NULL;
+    gz = __gz_mode(wcname, __modes);
+    /* open the leaf relative to a cached handle of its directory, so the firmware doesn't walk the whole path */
+    for(wc = leaf = wcname; *wc; wc++)
+        if(*wc == L'\\') leaf = wc;
+    if(leaf > wcname && leaf[1]) {
+        *leaf = 0;
+        dir = __dircache_get(root, wcname);
+        if(dir) { root = dir; leaf++; }
+        else *leaf = L'\\';
     }
-    if(!__root_dir) {
-        errno = ENODEV;
+    ret = __efi_open(root, dir ? leaf : wcname, __modes);
+    return ret && gz ? __gz_open(ret, gz) : ret;
+}
+
+FILE *fopenat (DIR *__dirp, const char_t *__filename, const char_t *__modes)
+{
+    FILE *ret;
+    wchar_t *wcname;
+    int gz;
+    if(!__dirp) return fopen(__filename, __modes);
+    if(__dirp->type != __FT_FILE) {
+        errno = EBADF;
         return NULL;
     }
-    errno = 0;
-    ret = (FILE*)malloc(sizeof(FILE));
-    if(!ret) return NULL;
-#if USE_UTF8
-    mbstowcs((wchar_t*)&wcname, __filename, BUFSIZ - 1);
-    status = __root_dir->Open(__root_dir, &ret, (wchar_t*)&wcname,
-#else
-    status = __root_dir->Open(__root_dir, &ret, (wchar_t*)__filename,
-#endif
-        __modes[0] == CL('w') ? (EFI_FILE_MODE_WRITE | EFI_FILE_MODE_READ | EFI_FILE_MODE_CREATE) : EFI_FILE_MODE_READ,
-        __modes[1] == CL('d') ? EFI_FILE_DIRECTORY : 0);
-    if(EFI_ERROR(status)) {
-err:    __stdio_seterrno(status);
-        free(ret); return NULL;
+    if(!__filename || !*__filename || !__modes || !*__modes) {
+        errno = EINVAL;
+        return NULL;
     }
-    status = ret->GetInfo(ret, &infGuid, &fsiz, &info);
-    if(EFI_ERROR(status)) goto err;
-    if(__modes[1] == CL('d') && !(info.Attribute & EFI_FILE_DIRECTORY)) {
-        free(ret); errno = ENOTDIR; return NULL;
+    if(!(wcname = __stdio_wpath(__filename))) return NULL;
+    gz = __gz_mode(wcname, __modes);
+    ret = __efi_open(__dirp->h.fh, wcname, __modes);
+    return ret && gz ? __gz_open(ret, gz) : ret;
+}
+
+FILE *fmemopen (void *__s, size_t __len, const char_t *__modes)
+{
+    FILE *ret;
+    uint8_t *end;
+    if(!__len || !__modes || !*__modes) {
+        errno = EINVAL;
+        return NULL;
     }
-    if(__modes[1] != CL('d') && (info.Attribute & EFI_FILE_DIRECTORY)) {
-        free(ret); errno = EISDIR; return NULL;
+    if(!(ret = __stdio_alloc(__FT_MEM, &__mem_ops))) return NULL;
+    if(!__s) {
+        if(!(__s = calloc(1, __len))) {
+            ret->type = 0;
+            return NULL;
+        }
+        ret->flags |= __FF_FREEBUF;
     }
-    if(__modes[0] == CL('a')) fseek(ret, 0, SEEK_END);
+    ret->h.mem = (uint8_t*)__s;
+    ret->size = __len;
+    if(__modes[0] == CL('r') && __modes[1] != CL('+')) ret->flags |= __FF_RDONLY;
+    if(__modes[0] == CL('w')) ret->h.mem[0] = 0;
+    if(__modes[0] == CL('a') && (end = memchr(ret->h.mem, 0, __len))) ret->offset = end - ret->h.mem;
     return ret;
 }
 
 size_t fread (void *__ptr, size_t __size, size_t __n, FILE *__stream)
 {
-    uintn_t bs = __size * __n, i, n;
-    efi_status_t status;
-    if(__stream == stdin || __stream == stdout || __stream == stderr) {
-        errno = ESPIPE;
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
         return 0;
     }
-    if(__ser && __stream == (FILE*)__ser) {
-        status = __ser->Read(__ser, &bs, __ptr);
-    } else {
-        for(i = 0; i < __blk_ndevs; i++)
-            if(__stream == (FILE*)__blk_devs[i].bio) {
-                n = __blk_devs[i].offset / __blk_devs[i].bio->Media->BlockSize;
-                bs = (bs / __blk_devs[i].bio->Media->BlockSize) * __blk_devs[i].bio->Media->BlockSize;
-                status = __blk_devs[i].bio->ReadBlocks(__blk_devs[i].bio, __blk_devs[i].bio->Media->MediaId, n, bs, __ptr);
-                if(EFI_ERROR(status)) {
-                    __stdio_seterrno(status);
-                    return 0;
-                }
-                __blk_devs[i].offset += bs;
-                return bs / __size;
+    if(!__size) return 0;
+    return __stream->ops->read(__stream, __ptr, __size * __n) / __size;
+}
+
+size_t fwrite (const void *__ptr, size_t __size, size_t __n, FILE *__stream)
+{
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return 0;
+    }
+    if(!__size) return 0;
+    return __stream->ops->write(__stream, __ptr, __size * __n) / __size;
+}
+
+int fseek (FILE *__stream, long int __off, int __whence)
+{
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return -1;
+    }
+    return __stream->ops->seek(__stream, (int64_t)__off, __whence);
+}
+
+long int ftell (FILE *__stream)
+{
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return -1;
+    }
+    return (long int)__stream->ops->tell(__stream);
+}
+
+int fseeko (FILE *__stream, off_t __off, int __whence)
+{
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return -1;
+    }
+    return __stream->ops->seek(__stream, (int64_t)__off, __whence);
+}
+
+off_t ftello (FILE *__stream)
+{
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return (off_t)-1;
+    }
+    return __stream->ops->tell(__stream);
+}
+
+/* positioned transfer in a single library call, the stream's position doesn't change */
+static ssize_t __stdio_pio (FILE *__stream, void *__buf, size_t __n, off_t __off, int wr)
+{
+    efi_block_io_t *bio;
+    efi_file_handle_t *fh;
+    efi_status_t status = EFI_SUCCESS;
+    uintn_t bs = __n;
+    if(!__stream || !__stream->type || (wr && (__stream->flags & __FF_RDONLY))) {
+        errno = EBADF;
+        return -1;
+    }
+    if(!__buf && __n) {
+        errno = EINVAL;
+        return -1;
+    }
+    switch(__stream->type) {
+        case __FT_BLK:
+            /* one firmware call, the shared offset isn't touched */
+            bio = __stream->h.bio;
+            if(__off % bio->Media->BlockSize) {
+                errno = EINVAL;
+                return -1;
             }
-        status = __stream->Read(__stream, &bs, __ptr);
+            bs = (__n / bio->Media->BlockSize) * bio->Media->BlockSize;
+            if(bs)
+                status = wr ? bio->WriteBlocks(bio, bio->Media->MediaId, __off / bio->Media->BlockSize, bs, __buf) :
+                    bio->ReadBlocks(bio, bio->Media->MediaId, __off / bio->Media->BlockSize, bs, __buf);
+        break;
+        case __FT_FILE:
+            fh = __stream->h.fh;
+            if(__efi_sync(__stream)) return -1;
+            /* no need to position the handle if it's already there */
+            if(__off != __stream->offset || (__stream->flags & __FF_MOVED))
+                status = fh->SetPosition(fh, (uint64_t)__off);
+            if(!EFI_ERROR(status))
+                status = wr ? fh->Write(fh, &bs, __buf) : fh->Read(fh, &bs, __buf);
+            /* the handle is restored to the stream's position lazily, on the next fread or fwrite */
+            __stream->flags |= __FF_MOVED;
+            if(EFI_ERROR(status)) break;
+            if(__off + bs > __stream->size || (!wr && bs < __n)) __stream->size = __off + bs;
+        break;
+        case __FT_MEM:
+            if(__off >= __stream->size) {
+                if(!wr) return 0;
+                errno = ENOSPC;
+                return -1;
+            }
+            if(bs > __stream->size - __off) bs = __stream->size - __off;
+            if(wr) memcpy(__stream->h.mem + __off, __buf, bs);
+            else memcpy(__buf, __stream->h.mem + __off, bs);
+        break;
+        default:
+            errno = ESPIPE;
+            return -1;
     }
     if(EFI_ERROR(status)) {
         __stdio_seterrno(status);
+        return -1;
+    }
+    return (ssize_t)bs;
+}
+
+ssize_t pread (FILE *__stream, void *__buf, size_t __n, off_t __off)
+{
+    return __stdio_pio(__stream, __buf, __n, __off, 0);
+}
+
+ssize_t pwrite (FILE *__stream, const void *__buf, size_t __n, off_t __off)
+{
+    return __stdio_pio(__stream, (void*)__buf, __n, __off, 1);
+}
+
+/* length of the run of memory contiguous segments starting at iov[i] + off, *end is the segment after it */
+static size_t __iov_run (const struct iovec *iov, int cnt, int i, size_t off, int *end)
+{
+    size_t len = iov[i].iov_len - off;
+    for(i++; i < cnt && (uint8_t*)iov[i - 1].iov_base + iov[i - 1].iov_len == (uint8_t*)iov[i].iov_base; i++)
+        len += iov[i].iov_len;
+    *end = i;
+    return len;
+}
+
+/* scatter n bytes of buf from iov[*i] + *off onwards, or gather them into buf */
+static void __iov_copy (const struct iovec *iov, int cnt, int *i, size_t *off, uint8_t *buf, size_t n, int gather)
+{
+    size_t k;
+    while(n && *i < cnt) {
+        k = iov[*i].iov_len - *off;
+        if(k > n) k = n;
+        if(buf) {
+            if(gather) memcpy(buf, (uint8_t*)iov[*i].iov_base + *off, k);
+            else memcpy((uint8_t*)iov[*i].iov_base + *off, buf, k);
+            buf += k;
+        }
+        n -= k;
+        *off += k;
+        if(*off == iov[*i].iov_len) { (*i)++; *off = 0; }
+    }
+}
+
+/**
+ * Vectored transfer. Runs of segments that are contiguous in memory are passed to the firmware in one call, and
+ * small segments are collected in a bounce buffer, so a dozen headers cost one Write (or one ReadBlocks).
+ */
+static ssize_t __stdio_iov (FILE *__stream, const struct iovec *__iov, int __iovcnt, int wr)
+{
+    uint8_t *bounce = NULL, *p;
+    size_t gran = 1, bsiz, fill = 0, total = 0, len, k, n, off = 0;
+    int i = 0, j, r;
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return -1;
+    }
+    if(__iovcnt < 0 || __iovcnt > IOV_MAX || (!__iov && __iovcnt)) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* block devices transfer whole blocks, so the bounce buffer is flushed in whole blocks */
+    if(__stream->type == __FT_BLK) gran = __stream->h.bio->Media->BlockSize;
+    bsiz = __IOVBUFSIZ > gran ? __IOVBUFSIZ / gran * gran : gran;
+    errno = 0;
+    while(i < __iovcnt) {
+        if(off == __iov[i].iov_len) { i++; off = 0; continue; }
+        p = (uint8_t*)__iov[i].iov_base + off;
+        len = __iov_run(__iov, __iovcnt, i, off, &j);
+        /* the last or a large run goes straight to the firmware (or without a bounce buffer, everything does) */
+        if(!fill && (j == __iovcnt || len >= bsiz / 2 || (!bounce && !(bounce = (uint8_t*)malloc(bsiz))))) {
+            k = j == __iovcnt || len < gran ? len : len / gran * gran;
+            n = wr ? __stream->ops->write(__stream, p, k) : __stream->ops->read(__stream, p, k);
+            total += n;
+            __iov_copy(__iov, __iovcnt, &i, &off, NULL, n, 0);
+            if(n < k) goto end;
+            continue;
+        }
+        if(wr) {
+            k = len < bsiz - fill ? len : bsiz - fill;
+            memcpy(bounce + fill, p, k);
+            fill += k;
+            __iov_copy(__iov, __iovcnt, &i, &off, NULL, k, 0);
+            if(fill == bsiz) {
+                n = __stream->ops->write(__stream, bounce, fill);
+                total += n;
+                if(n < fill) goto end;
+                fill = 0;
+            }
+        } else {
+            /* read the small runs up to the next large one in one go, and scatter them */
+            for(k = len, r = j; r < __iovcnt && k < bsiz; r = j) {
+                len = __iov_run(__iov, __iovcnt, r, 0, &j);
+                if(len >= bsiz / 2) break;
+                k += len;
+            }
+            if(k > bsiz) k = bsiz;
+            if(k > gran) k = k / gran * gran;
+            n = __stream->ops->read(__stream, bounce, k);
+            total += n;
+            __iov_copy(__iov, __iovcnt, &i, &off, bounce, n, 0);
+            if(n < k) goto end;
+        }
+    }
+    if(fill) total += __stream->ops->write(__stream, bounce, fill);
+end:
+    free(bounce);
+    return !total && errno ? -1 : (ssize_t)total;
+}
+
+ssize_t readv (FILE *__stream, const struct iovec *__iov, int __iovcnt)
+{
+    return __stdio_iov(__stream, __iov, __iovcnt, 0);
+}
+
+ssize_t writev (FILE *__stream, const struct iovec *__iov, int __iovcnt)
+{
+    return __stdio_iov(__stream, __iov, __iovcnt, 1);
+}
+
+int feof (FILE *__stream)
+{
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
         return 0;
     }
-    return bs / __size;
+    return __stream->ops->eof(__stream);
+}
+
+#define __AIO_OWNEVENT  1
+#define __AIO_DONE      2
+
+static int __aio_submit (struct aiocb *__aiocbp, int wr)
+{
+    efi_status_t status;
+    efi_block_io_t *bio;
+    efi_block_io2_t *bio2;
+    efi_file_handle_t *fh;
+    FILE *f;
+    if(!__aiocbp || !__aiocbp->aio_fildes || !__aiocbp->aio_fildes->type ||
+      (!__aiocbp->aio_buf && __aiocbp->aio_nbytes)) {
+        errno = EINVAL;
+        return -1;
+    }
+    f = __aiocbp->aio_fildes;
+    if(f->type == __FT_CON || f->type == __FT_SER) {
+        errno = ESPIPE;
+        return -1;
+    }
+    __aiocbp->__flags = 0;
+    if(!__aiocbp->aio_event) {
+        status = BS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &__aiocbp->aio_event);
+        if(EFI_ERROR(status)) {
+            __stdio_seterrno(status);
+            return -1;
+        }
+        __aiocbp->__flags |= __AIO_OWNEVENT;
+    }
+    __aiocbp->__token.Event = __aiocbp->aio_event;
+    __aiocbp->__token.Status = EFI_NOT_READY;
+    __aiocbp->__token.BufferSize = __aiocbp->aio_nbytes;
+    __aiocbp->__token.Buffer = (void*)__aiocbp->aio_buf;
+    switch(f->type) {
+        case __FT_BLK:
+            bio = f->h.bio;
+            __aiocbp->__token.BufferSize = (__aiocbp->aio_nbytes / bio->Media->BlockSize) * bio->Media->BlockSize;
+            if((bio2 = __blk_io2(bio))) {
+                /* the file token starts with the same Event and Status fields as a Block IO 2 token */
+                status = wr ?
+                    bio2->WriteBlocksEx(bio2, bio->Media->MediaId, __aiocbp->aio_offset / bio->Media->BlockSize,
+                        (efi_block_io2_token_t*)&__aiocbp->__token, __aiocbp->__token.BufferSize, __aiocbp->__token.Buffer) :
+                    bio2->ReadBlocksEx(bio2, bio->Media->MediaId, __aiocbp->aio_offset / bio->Media->BlockSize,
+                        (efi_block_io2_token_t*)&__aiocbp->__token, __aiocbp->__token.BufferSize, __aiocbp->__token.Buffer);
+                if(!EFI_ERROR(status)) return 0;
+                if(status != EFI_UNSUPPORTED) goto err;
+            }
+            /* Block IO has no tokens, do the transfer right away */
+            status = wr ?
+                bio->WriteBlocks(bio, bio->Media->MediaId, __aiocbp->aio_offset / bio->Media->BlockSize,
+                    __aiocbp->__token.BufferSize, __aiocbp->__token.Buffer) :
+                bio->ReadBlocks(bio, bio->Media->MediaId, __aiocbp->aio_offset / bio->Media->BlockSize,
+                    __aiocbp->__token.BufferSize, __aiocbp->__token.Buffer);
+            break;
+        case __FT_FILE:
+            fh = f->h.fh;
+            /* the handle's position is going to change under the stream */
+            f->flags |= __FF_STALE;
+            status = fh->SetPosition(fh, __aiocbp->aio_offset);
+            if(EFI_ERROR(status)) goto err;
+            if(fh->Revision >= EFI_FILE_PROTOCOL_REVISION2) {
+                /* the firmware will update the token and signal the event when it's done */
+                status = wr ? fh->WriteEx(fh, &__aiocbp->__token) : fh->ReadEx(fh, &__aiocbp->__token);
+                if(!EFI_ERROR(status)) return 0;
+                if(status != EFI_UNSUPPORTED) goto err;
+            }
+            /* revision 1 file protocol, emulate asynchronous I/O with a synchronous call */
+            status = wr ? fh->Write(fh, &__aiocbp->__token.BufferSize, __aiocbp->__token.Buffer) :
+                fh->Read(fh, &__aiocbp->__token.BufferSize, __aiocbp->__token.Buffer);
+            break;
+        default:
+            /* any other seekable stream, synchronous transfer through its operations */
+            if(f->ops->seek(f, __aiocbp->aio_offset, SEEK_SET)) { status = EFI_INVALID_PARAMETER; goto err; }
+            __aiocbp->__token.BufferSize = wr ? f->ops->write(f, __aiocbp->__token.Buffer, __aiocbp->aio_nbytes) :
+                f->ops->read(f, __aiocbp->__token.Buffer, __aiocbp->aio_nbytes);
+            status = EFI_SUCCESS;
+            break;
+    }
+    if(EFI_ERROR(status)) __aiocbp->__token.BufferSize = 0;
+    __aiocbp->__token.Status = status;
+    BS->SignalEvent(__aiocbp->aio_event);
+    return 0;
+err:
+    __stdio_seterrno(status);
+    if(__aiocbp->__flags & __AIO_OWNEVENT) {
+        BS->CloseEvent(__aiocbp->aio_event);
+        __aiocbp->aio_event = NULL;
+    }
+    __aiocbp->__flags = 0;
+    return -1;
+}
+
+int aio_read (struct aiocb *__aiocbp)
+{
+    return __aio_submit(__aiocbp, 0);
+}
+
+int aio_write (struct aiocb *__aiocbp)
+{
+    return __aio_submit(__aiocbp, 1);
+}
+
+int aio_error (const struct aiocb *__aiocbp)
+{
+    struct aiocb *cb = (struct aiocb*)__aiocbp;
+    if(!cb || !cb->aio_event) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(!(cb->__flags & __AIO_DONE)) {
+        /* CheckEvent resets the signaled state, so remember the completion */
+        if(cb->__token.Status == EFI_NOT_READY && BS->CheckEvent(cb->aio_event) != EFI_SUCCESS)
+            return EINPROGRESS;
+        cb->__flags |= __AIO_DONE;
+    }
+    if(!EFI_ERROR(cb->__token.Status)) return 0;
+    __stdio_seterrno(cb->__token.Status);
+    return errno;
+}
+
+ssize_t aio_return (struct aiocb *__aiocbp)
+{
+    int err = aio_error(__aiocbp);
+    if(err == -1 || err == EINPROGRESS) {
+        if(err != -1) errno = EINPROGRESS;
+        return -1;
+    }
+    if(__aiocbp->__flags & __AIO_OWNEVENT) {
+        BS->CloseEvent(__aiocbp->aio_event);
+        __aiocbp->aio_event = NULL;
+    }
+    __aiocbp->__flags = 0;
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return (ssize_t)__aiocbp->__token.BufferSize;
 }
 
-size_t fwrite (const void *__ptr, size_t __size, size_t __n, FILE *__stream)
+int aio_suspend (const struct aiocb *const __list[], int __nent, const struct timespec *__timeout)
 {
-    uintn_t bs = __size * __n, n, i;
+    efi_event_t events[AIO_LISTIO_MAX + 1];
+    int i, n = 0, map[AIO_LISTIO_MAX];
+    uintn_t idx = 0;
     efi_status_t status;
-    if(__stream == stdin || __stream == stdout || __stream == stderr) {
-        errno = ESPIPE;
-        return 0;
+    if(!__list || __nent < 1 || __nent > AIO_LISTIO_MAX) {
+        errno = EINVAL;
+        return -1;
     }
-    if(__ser && __stream == (FILE*)__ser) {
-        status = __ser->Write(__ser, &bs, (void*)__ptr);
-    } else {
-        for(i = 0; i < __blk_ndevs; i++)
-            if(__stream == (FILE*)__blk_devs[i].bio) {
-                n = __blk_devs[i].offset / __blk_devs[i].bio->Media->BlockSize;
-                bs = (bs / __blk_devs[i].bio->Media->BlockSize) * __blk_devs[i].bio->Media->BlockSize;
-                status = __blk_devs[i].bio->WriteBlocks(__blk_devs[i].bio, __blk_devs[i].bio->Media->MediaId, n, bs, (void*)__ptr);
-                if(EFI_ERROR(status)) {
-                    __stdio_seterrno(status);
-                    return 0;
-                }
-                __blk_devs[i].offset += bs;
-                return bs / __size;
-            }
-        status = __stream->Write(__stream, &bs, (void *)__ptr);
+    for(i = 0; i < __nent; i++) {
+        if(!__list[i]) continue;
+        if(aio_error(__list[i]) != EINPROGRESS) return 0;
+        map[n] = i;
+        events[n++] = __list[i]->aio_event;
+    }
+    if(!n) return 0;
+    if(__timeout) {
+        status = BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &events[n]);
+        if(EFI_ERROR(status)) goto err;
+        /* timer is in 100 nanosec units */
+        BS->SetTimer(events[n], TimerRelative, (uint64_t)__timeout->tv_sec * 10000000UL + __timeout->tv_nsec / 100);
     }
+    status = BS->WaitForEvent(n + (__timeout ? 1 : 0), events, &idx);
+    if(__timeout) BS->CloseEvent(events[n]);
     if(EFI_ERROR(status)) {
-        __stdio_seterrno(status);
-        return 0;
+err:    __stdio_seterrno(status);
+        return -1;
+    }
+    if(idx >= (uintn_t)n) {
+        errno = EAGAIN;
+        return -1;
     }
-    return bs / __size;
+    /* WaitForEvent resets the signaled state too */
+    ((struct aiocb*)__list[map[idx]])->__flags |= __AIO_DONE;
+    return 0;
 }
 
-int fseek (FILE *__stream, long int __off, int __whence)
+/*** formatted output ***/
+/* output chunk size for streams, in characters */
+#define __FMTCHUNK 128
+
+/* receives the formatted output in chunks, returns 0 if no more output is possible */
+typedef int (*__fmt_sink_t)(void *ctx, const char_t *buf, size_t n);
+
+typedef struct {
+    char_t *dst, *end;      /* next free character and end of the output buffer */
+    char_t *buf;            /* start of the output buffer */
+    char_t last;            /* last character written, survives flushes */
+    int total;              /* characters already passed to the sink */
+    __fmt_sink_t sink;      /* NULL when formatting into a string */
+    void *ctx;
+} __fmt_t;
+
+/* pass a full chunk to the sink */
+static int __fmt_flush (__fmt_t *o)
 {
-    off_t off = 0;
-    efi_status_t status;
-    efi_guid_t infoGuid = EFI_FILE_INFO_GUID;
-    efi_file_info_t info;
-    uintn_t fsiz = sizeof(efi_file_info_t), i;
-    if(__stream == stdin || __stream == stdout || __stream == stderr) {
-        errno = ESPIPE;
-        return -1;
-    }
-    if(__ser && __stream == (FILE*)__ser) {
-        errno = EBADF;
-        return -1;
+    size_t n = o->dst - o->buf;
+    if(!o->sink) return 0;
+    o->dst = o->buf;
+    if(!n) return 1;
+    o->total += n;
+    *(o->buf + n) = 0;
+    return (*o->sink)(o->ctx, o->buf, n);
+}
+
+/* sink for streams */
+static int __fmt_stream (void *ctx, const char_t *buf, size_t n)
+{
+    FILE *f = (FILE*)ctx;
+#if !defined(USE_UTF8) || !USE_UTF8
+    char tmp[__FMTCHUNK * 3 + 1];
+    int i;
+    /* serial lines are byte streams */
+    if(f->type == __FT_SER) {
+        i = wcstombs((char*)&tmp, buf, sizeof(tmp) - 1);
+        return i < 1 || f->ops->write(f, tmp, i) == (size_t)i;
     }
-    for(i = 0; i < __blk_ndevs; i++)
-        if(__stream == (FILE*)__blk_devs[i].bio) {
-            off = (uint64_t)__blk_devs[i].bio->Media->BlockSize * (uint64_t)__blk_devs[i].bio->Media->LastBlock;
-            switch(__whence) {
-                case SEEK_END:
-                    __blk_devs[i].offset = off + __off;
-                    break;
-                case SEEK_CUR:
-                    __blk_devs[i].offset += __off;
-                    break;
-                case SEEK_SET:
-                    __blk_devs[i].offset = __off;
-                    break;
-            }
-            if(__blk_devs[i].offset < 0) __blk_devs[i].offset = 0;
-            if(__blk_devs[i].offset > off) __blk_devs[i].offset = off;
-            __blk_devs[i].offset = (__blk_devs[i].offset / __blk_devs[i].bio->Media->BlockSize) *
-                __blk_devs[i].bio->Media->BlockSize;
-            return 0;
-        }
-    switch(__whence) {
-        case SEEK_END:
-            status = __stream->GetInfo(__stream, &infoGuid, &fsiz, &info);
-            if(!EFI_ERROR(status)) {
-                off = info.FileSize + __off;
-                status = __stream->SetPosition(__stream, off);
-            }
+#endif
+    return f->ops->write(f, buf, n * sizeof(char_t)) == n * sizeof(char_t);
+}
+
+/* two digits per step for decimal, and a branchless digit lookup for hex conversion */
+static const char __fmt_dec2[201] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+static const char __fmt_hex[33] = "0123456789abcdef0123456789ABCDEF";
+
+#define __FMT_LEFT  1
+#define __FMT_PLUS  2
+#define __FMT_SPACE 4
+#define __FMT_ALT   8
+#define __FMT_ZERO  16
+
+/* convert an unsigned integer backwards, ending at e, returns the first digit */
+static char_t *__fmt_utoa (char_t *e, uint64_t v, int base, int upper)
+{
+    const char *d;
+    switch(base) {
+        case 16:
+            d = __fmt_hex + (upper ? 16 : 0);
+            do { *--e = (char_t)d[v & 15]; v >>= 4; } while(v);
             break;
-        case SEEK_CUR:
-            status = __stream->GetPosition(__stream, &off);
-            if(!EFI_ERROR(status)) {
-                off += __off;
-                status = __stream->SetPosition(__stream, off);
-            }
+        case 8:
+            do { *--e = (char_t)(CL('0') + (v & 7)); v >>= 3; } while(v);
             break;
         default:
-            status = __stream->SetPosition(__stream, off);
+            while(v >= 100) {
+                d = __fmt_dec2 + (v % 100) * 2;
+                v /= 100;
+                *--e = (char_t)d[1]; *--e = (char_t)d[0];
+            }
+            if(v >= 10) {
+                d = __fmt_dec2 + v * 2;
+                *--e = (char_t)d[1]; *--e = (char_t)d[0];
+            } else
+                *--e = (char_t)(CL('0') + v);
             break;
     }
-    return EFI_ERROR(status) ? -1 : 0;
+    return e;
 }
 
-long int ftell (FILE *__stream)
+/* shortest decimal form of doubles, after Ulf Adams' Ryu. 5^i and 2^k/5^i are 125 bit fixed point numbers, only
+ * every 26th is stored, the rest is a multiplication by a small power of five plus a 2 bit correction from a bitmap */
+#define __FMT_POW5_BITS 125
+#define __fmt_pow5bits(e) ((int)(((uint32_t)(e) * 1217359) >> 19) + 1)
+static const uint64_t __fmt_pow5tab[26] = {
+    0x0000000000000001, 0x0000000000000005, 0x0000000000000019, 0x000000000000007d,
+    0x0000000000000271, 0x0000000000000c35, 0x0000000000003d09, 0x000000000001312d,
+    0x000000000005f5e1, 0x00000000001dcd65, 0x00000000009502f9, 0x0000000002e90edd,
+    0x000000000e8d4a51, 0x0000000048c27395, 0x000000016bcc41e9, 0x000000071afd498d,
+    0x0000002386f26fc1, 0x000000b1a2bc2ec5, 0x000003782dace9d9, 0x00001158e460913d,
+    0x000056bc75e2d631, 0x0001b1ae4d6e2ef5, 0x000878678326eac9, 0x002a5a058fc295ed,
+    0x00d3c21bcecceda1, 0x0422ca8b0a00a425
+};
+static const uint64_t __fmt_pow5_split[13][2] = {
+    { 0x0000000000000000, 0x1000000000000000 },
+    { 0x0000000000000000, 0x14adf4b7320334b9 },
+    { 0x0e549208b31adb10, 0x1aba4714957d300d },
+    { 0x6dc6ad264d8f0866, 0x1145b7e285bf98f5 },
+    { 0xeb1dbd923d8596ca, 0x1652efdc6018a1fc },
+    { 0xb4c1b80b22ae923c, 0x1cda62055b2d9d83 },
+    { 0x5bb28b4e8f7e4c30, 0x12a5568b9f52f416 },
+    { 0xf08aed437682d4fb, 0x1819651531f9e78f },
+    { 0xb4ee134ad99bf150, 0x1f25c186a6f04c28 },
+    { 0x16499ecb70c25f03, 0x1420eb449c8842e6 },
+    { 0x85a56ead360865b0, 0x1a03fde214caf085 },
+    { 0x093db1d57999890b, 0x10cfeb353a97dad8 },
+    { 0xcf38bb735e3f36ac, 0x15baaf44fa52673e }
+};
+static const uint32_t __fmt_pow5_offs[21] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x40000000, 0x59695995,
+    0x55545555, 0x56555515, 0x41150504, 0x40555410, 0x44555145, 0x44504540,
+    0x45555550, 0x40004000, 0x96440440, 0x55565565, 0x54454045, 0x40154151,
+    0x55559155, 0x51405555, 0x00000105
+};
+static const uint64_t __fmt_pow5_inv_split[15][2] = {
+    { 0x0000000000000001, 0x2000000000000000 },
+    { 0x52a6c95fc0655034, 0x18c240c4aecb13bb },
+    { 0x7ca8d50071dfc806, 0x1327fc58da0f6ff5 },
+    { 0x6520247d3556476e, 0x1da48ce468e7c702 },
+    { 0x6139cdd76802e6e9, 0x16ef5b40c2fc7779 },
+    { 0xf951a7ff43de8c79, 0x11bebdf578b2f391 },
+    { 0x7be8bee8d6e957e8, 0x1b758d848fac54b0 },
+    { 0x8bd3f9e999a423ea, 0x153eda614071a3b7 },
+    { 0x0848f973cb3ee3ce, 0x10701bd527b4978c },
+    { 0x153285ebb9efbfa2, 0x196fbb9bb44db44d },
+    { 0xadeee7f86c07b696, 0x13ae3591f5b4d936 },
+    { 0x4d686a4eaf182222, 0x1e74404f3daada91 },
+    { 0x98c0a106e09ebd9f, 0x17900ea4fda7c257 },
+    { 0x8f20e37371497d0e, 0x123b140576d820b2 },
+    { 0xb043138134743d85, 0x1c35f4275f7a29ad }
+};
+static const uint32_t __fmt_pow5_inv_offs[22] = {
+    0xaaaa9aa8, 0x5546aa5a, 0x25555555, 0x55955859, 0x8a666559, 0x9a6aaaaa,
+    0x554459a6, 0x515a5554, 0x55555544, 0x68555a96, 0x555a99a9, 0xaa654699,
+    0xa66965a9, 0x96959554, 0x56455566, 0x55965a55, 0xaaa6a855, 0x4aaaaaaa,
+    0xa9956956, 0x95585555, 0x56595565, 0x00000645
+};
+/* 64 x 64 -> 128 bit multiplication, returns the low half */
+static uint64_t __fmt_umul128 (uint64_t a, uint64_t b, uint64_t *hi)
 {
-    uint64_t off = 0;
-    uintn_t i;
-    efi_status_t status;
-    if(__stream == stdin || __stream == stdout || __stream == stderr) {
-        errno = ESPIPE;
-        return -1;
-    }
-    if(__ser && __stream == (FILE*)__ser) {
-        errno = EBADF;
-        return -1;
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)a * b;
+    *hi = (uint64_t)(r >> 64);
+    return (uint64_t)r;
+#else
+    uint64_t ll = (a & 0xffffffff) * (b & 0xffffffff), lh = (a & 0xffffffff) * (b >> 32);
+    uint64_t hl = (a >> 32) * (b & 0xffffffff), mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+    *hi = (a >> 32) * (b >> 32) + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return (mid << 32) | (ll & 0xffffffff);
+#endif
+}
+
+/* multiply a 128 bit number by m, and return 128 bits of the product starting at bit s (0 < s < 64) */
+static void __fmt_mul128 (const uint64_t *a, uint64_t m, int s, uint64_t *r)
+{
+    uint64_t h0, h1, l0, l1, sum;
+    l1 = __fmt_umul128(m, a[1], &h1);
+    l0 = __fmt_umul128(m, a[0], &h0);
+    sum = h0 + l1;
+    if(sum < h0) h1++;
+    r[0] = (sum << (64 - s)) | (l0 >> s);
+    r[1] = (h1 << (64 - s)) | (sum >> s);
+}
+
+/* 5^i, and 2^k/5^i rounded up */
+static void __fmt_pow5 (int i, uint64_t *r)
+{
+    int b = i / 26;
+    if(i == b * 26) { r[0] = __fmt_pow5_split[b][0]; r[1] = __fmt_pow5_split[b][1]; return; }
+    __fmt_mul128(__fmt_pow5_split[b], __fmt_pow5tab[i - b * 26], __fmt_pow5bits(i) - __fmt_pow5bits(b * 26), r);
+    r[0] += (__fmt_pow5_offs[i / 16] >> ((i % 16) * 2)) & 3;
+}
+
+static void __fmt_invpow5 (int i, uint64_t *r)
+{
+    int b = (i + 25) / 26;
+    if(i == b * 26) { r[0] = __fmt_pow5_inv_split[b][0]; r[1] = __fmt_pow5_inv_split[b][1]; return; }
+    __fmt_mul128(__fmt_pow5_inv_split[b], __fmt_pow5tab[b * 26 - i], __fmt_pow5bits(b * 26) - __fmt_pow5bits(i), r);
+    r[0] = r[0] - 1 + ((__fmt_pow5_inv_offs[i / 16] >> ((i % 16) * 2)) & 3);
+}
+
+/* m * a >> j, with 64 < j < 128 */
+static uint64_t __fmt_mulshift (uint64_t m, const uint64_t *a, int j)
+{
+    uint64_t r[2];
+    __fmt_mul128(a, m, j - 64, r);
+    return r[1];
+}
+
+static int __fmt_pow5fact (uint64_t v)
+{
+    int i;
+    for(i = 0; v && !(v % 5); i++, v /= 5);
+    return i;
+}
+
+/* shortest d * 10^e which reads back as m2 * 2^e2 (a non-zero, finite double), returns d */
+static uint64_t __fmt_d2d (uint64_t m2, int e2, int *e)
+{
+    uint64_t mv, vr, vp, vm, pow5[2];
+    int q, j, removed = 0, last = 0, up = 0, even = !(m2 & 1), mmshift, vmzeros = 0, vrzeros = 0;
+
+    /* the interval of the numbers which round to this double: [mv - 1 - mmshift, mv + 2] * 2^(e2 - 2) */
+    mmshift = m2 != (1ULL << 52) || e2 <= -1074;
+    e2 -= 2;
+    mv = 4 * m2;
+    /* scale the interval by a power of ten */
+    if(e2 >= 0) {
+        q = (int)(((uint32_t)e2 * 78913) >> 18) - (e2 > 3);
+        *e = q;
+        __fmt_invpow5(q, pow5);
+        j = -e2 + q + __FMT_POW5_BITS + __fmt_pow5bits(q) - 1;
+        vr = __fmt_mulshift(mv, pow5, j);
+        vp = __fmt_mulshift(mv + 2, pow5, j);
+        vm = __fmt_mulshift(mv - 1 - mmshift, pow5, j);
+        if(q <= 21) {
+            if(!(mv % 5)) vrzeros = __fmt_pow5fact(mv) >= q; else
+            if(even) vmzeros = __fmt_pow5fact(mv - 1 - mmshift) >= q; else
+                vp -= __fmt_pow5fact(mv + 2) >= q;
+        }
+    } else {
+        q = (int)(((uint32_t)-e2 * 732923) >> 20) - (-e2 > 1);
+        *e = q + e2;
+        __fmt_pow5(-e2 - q, pow5);
+        j = q - __fmt_pow5bits(-e2 - q) + __FMT_POW5_BITS;
+        vr = __fmt_mulshift(mv, pow5, j);
+        vp = __fmt_mulshift(mv + 2, pow5, j);
+        vm = __fmt_mulshift(mv - 1 - mmshift, pow5, j);
+        if(q <= 1) {
+            vrzeros = 1;
+            if(even) vmzeros = mmshift; else vp--;
+        } else if(q < 63)
+            vrzeros = !(mv & ((1ULL << q) - 1));
     }
-    for(i = 0; i < __blk_ndevs; i++)
-        if(__stream == (FILE*)__blk_devs[i].bio) {
-            return (long int)__blk_devs[i].offset;
+    /* remove digits while the interval still has a number with that many trailing zeros */
+    if(vmzeros || vrzeros) {
+        for(; vp / 10 > vm / 10; vr /= 10, vp /= 10, vm /= 10, removed++) {
+            vmzeros &= !(vm % 10);
+            vrzeros &= !last;
+            last = (int)(vr % 10);
+        }
+        if(vmzeros)
+            for(; !(vm % 10); vr /= 10, vp /= 10, vm /= 10, removed++) {
+                vrzeros &= !last;
+                last = (int)(vr % 10);
+            }
+        /* exactly half way, round to even */
+        if(vrzeros && last == 5 && !(vr & 1)) last = 4;
+        up = (vr == vm && (!even || !vmzeros)) || last >= 5;
+    } else {
+        if(vp / 100 > vm / 100) {
+            up = vr % 100 >= 50;
+            vr /= 100; vp /= 100; vm /= 100; removed += 2;
         }
-    status = __stream->GetPosition(__stream, &off);
-    return EFI_ERROR(status) ? -1 : (long int)off;
+        for(; vp / 10 > vm / 10; vr /= 10, vp /= 10, vm /= 10, removed++)
+            up = vr % 10 >= 5;
+        up |= vr == vm;
+    }
+    *e += removed;
+    return vr + up;
 }
 
-int feof (FILE *__stream)
+/* exact comparison of m2 * 2^e2 and d * 10^e, to resolve ties when rounding the shortest digits */
+#define __FMT_BIGLEN 32
+typedef struct { int n; uint32_t w[__FMT_BIGLEN]; } __fmt_big_t;
+
+static void __fmt_bigmul (__fmt_big_t *b, uint32_t m)
 {
-    uint64_t off = 0;
-    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
-    efi_file_info_t info;
-    uintn_t fsiz = (uintn_t)sizeof(efi_file_info_t), i;
-    efi_status_t status;
-    if(__stream == stdin || __stream == stdout || __stream == stderr) {
-        errno = ESPIPE;
-        return 0;
-    }
-    if(__ser && __stream == (FILE*)__ser) {
-        errno = EBADF;
-        return 0;
+    uint64_t c = 0;
+    int i;
+    for(i = 0; i < b->n; i++) { c += (uint64_t)b->w[i] * m; b->w[i] = (uint32_t)c; c >>= 32; }
+    if(c) b->w[b->n++] = (uint32_t)c;
+}
+
+static void __fmt_bigscale (__fmt_big_t *b, uint64_t v, int p2, int p5)
+{
+    int i, s = p2 & 31;
+    b->n = 0;
+    for(; v; v >>= 32) b->w[b->n++] = (uint32_t)v;
+    for(; p5 >= 13; p5 -= 13) __fmt_bigmul(b, 1220703125);
+    if(p5) __fmt_bigmul(b, (uint32_t)__fmt_pow5tab[p5]);
+    if(s) __fmt_bigmul(b, 1U << s);
+    if((p2 >>= 5)) {
+        for(i = b->n - 1; i >= 0; i--) b->w[i + p2] = b->w[i];
+        for(i = 0; i < p2; i++) b->w[i] = 0;
+        b->n += p2;
     }
-    for(i = 0; i < __blk_ndevs; i++)
-        if(__stream == (FILE*)__blk_devs[i].bio) {
-            errno = EBADF;
-            return __blk_devs[i].offset == (off_t)__blk_devs[i].bio->Media->BlockSize * (off_t)__blk_devs[i].bio->Media->LastBlock;
+}
+
+static int __fmt_cmpexact (uint64_t m2, int e2, uint64_t d, int e)
+{
+    __fmt_big_t a, b;
+    int i;
+    __fmt_bigscale(&a, m2, e2 > e ? e2 - e : 0, e < 0 ? -e : 0);
+    __fmt_bigscale(&b, d, e > e2 ? e - e2 : 0, e > 0 ? e : 0);
+    if(a.n != b.n) return a.n - b.n;
+    for(i = a.n - 1; i >= 0 && a.w[i] == b.w[i]; i--);
+    return i < 0 ? 0 : (a.w[i] > b.w[i] ? 1 : -1);
+}
+
+/* convert m2 * 2^e2 to p significant decimal digits, or to p digits after the point for %f. Digits past the shortest
+ * round trip representation are zeros. Returns the number of digits in dig (no trailing zeros), and the exponent of
+ * the first digit in x */
+static int __fmt_dtoa (uint64_t m2, int e2, int p, int fixed, char *dig, int *x)
+{
+    uint64_t d;
+    int e, n, i;
+    char tmp[24], *s;
+
+    if(!m2) { *x = 0; return 0; }
+    d = __fmt_d2d(m2, e2, &e);
+    s = tmp + sizeof(tmp);
+    do { *--s = '0' + (char)(d % 10); d /= 10; } while(d);
+    n = (int)(tmp + sizeof(tmp) - s);
+    *x = e + n - 1;
+    if(fixed) p += *x + 1;
+    if(p < n) {
+        /* round half up, except for exact ties which are decided on the binary value, half to even */
+        i = p >= 0 && s[p] > '5' ? 1 : (p >= 0 && s[p] < '5') || p < 0 ? -1 : 0;
+        if(!i) {
+            for(i = p + 1; i < n && s[i] == '0'; i++);
+            if(i < n) i = 1; else {
+                for(d = 0, i = 0; i < n; i++) d = d * 10 + (uint64_t)(s[i] - '0');
+                i = __fmt_cmpexact(m2, e2, d, e);
+                if(!i) i = p > 0 && (s[p - 1] & 1) ? 1 : -1;
+            }
+        }
+        n = p < 0 ? 0 : p;
+        if(i > 0) {
+            for(i = n - 1; i >= 0 && s[i] == '9'; i--);
+            if(i < 0) { s[0] = '1'; n = 1; (*x)++; } else { s[i]++; n = i + 1; }
         }
-    status = __stream->GetPosition(__stream, &off);
-    if(EFI_ERROR(status)) {
-err:    __stdio_seterrno(status);
-        return 1;
     }
-    status = __stream->GetInfo(__stream, &infGuid, &fsiz, &info);
-    if(EFI_ERROR(status)) goto err;
-    __stream->SetPosition(__stream, off);
-    return info.FileSize == off;
+    for(; n > 0 && s[n - 1] == '0'; n--);
+    for(i = 0; i < n; i++) dig[i] = s[i];
+    return n;
 }
 
-int vsnprintf(char_t *dst, size_t maxlen, const char_t *fmt, __builtin_va_list args)
+/* long double arguments are printed with double precision */
+static double __fmt_ldbl (long double v)
 {
+#if __LDBL_MANT_DIG__ == 113
+    /* IEEE quad precision, converted by hand because there's no soft float library. Denormals become zero */
+    union { long double l; uint64_t w[2]; } u;
+    union { uint64_t u; double d; } r;
+    int e;
+    u.l = v;
+    e = (int)((u.w[1] >> 48) & 0x7fff);
+    r.u = u.w[1] & (1ULL << 63);
+    if(e == 0x7fff) r.u |= (0x7ffULL << 52) | ((u.w[1] << 16) || u.w[0] ? 1ULL << 51 : 0); else
+    if((e += 1023 - 16383) >= 0x7ff) r.u |= 0x7ffULL << 52; else
+    if(e > 0) r.u += (((uint64_t)e << 52) | ((u.w[1] & 0xffffffffffffULL) << 4) | (u.w[0] >> 60)) + ((u.w[0] >> 59) & 1);
+    return r.d;
+#else
+    return (double)v;
+#endif
+}
+
+/* the formatter itself, used by all the printf variants */
+static int __vformat (__fmt_t *o, const char_t *fmt, __builtin_va_list args)
+{
+#define out(a) do { if(o->dst >= o->end && !__fmt_flush(o)) goto zro; o->last = *o->dst++ = (a); } while(0)
+#define pad(a, l) do { for(; (l) > 0; (l)--) out(a); } while(0)
 #define needsescape(a) (a==CL('\"') || a==CL('\\') || a==CL('\a') || a==CL('\b') || a==CL('\033') || a==CL('\f') || \
     a==CL('\r') || a==CL('\n') || a==CL('\t') || a==CL('\v'))
     efi_physical_address_t m;
     uint8_t *mem;
-    int64_t arg;
-    int len, sign, i, j;
-    char_t *p, *orig=dst, *end = dst + maxlen - 1, tmpstr[19], pad, n;
+    uint64_t arg;
+    int64_t sarg;
+    union { double d; uint64_t u; } dbl;
+    int flags, width, prec, size, len, i, j, x, e;
+    char_t *p, tmpstr[24], prefix[2], n;
+    char dig[24];
 #if !defined(USE_UTF8) || !USE_UTF8
     char *c;
 #endif
-    if(dst==NULL || fmt==NULL)
-        return 0;
+    if(fmt==NULL)
+        goto zro;
 
-    arg = 0;
-    while(*fmt && dst < end) {
-        if(*fmt==CL('%')) {
+    while(*fmt) {
+        if(*fmt!=CL('%')) {
+put:        if(*fmt == CL('\n') && o->last != CL('\r')) out(CL('\r'));
+            out(*fmt);
+            fmt++;
+            continue;
+        }
+        fmt++;
+        /* flags, width, precision and length modifier */
+        for(flags = 0;; fmt++) {
+            if(*fmt==CL('-')) flags |= __FMT_LEFT; else
+            if(*fmt==CL('+')) flags |= __FMT_PLUS; else
+            if(*fmt==CL(' ')) flags |= __FMT_SPACE; else
+            if(*fmt==CL('#')) flags |= __FMT_ALT; else
+            if(*fmt==CL('0')) flags |= __FMT_ZERO; else
+                break;
+        }
+        width = 0;
+        if(*fmt==CL('*')) {
+            width = __builtin_va_arg(args, int);
+            if(width < 0) { flags |= __FMT_LEFT; width = -width; }
             fmt++;
-            if(*fmt==CL('%')) goto put;
-            len=0; pad=CL(' ');
-            if(*fmt==CL('0')) pad=CL('0');
-            while(*fmt>=CL('0') && *fmt<=CL('9')) {
-                len *= 10;
-                len += *fmt-CL('0');
+        } else
+            for(; *fmt>=CL('0') && *fmt<=CL('9'); fmt++) width = width * 10 + *fmt - CL('0');
+        prec = -1;
+        if(*fmt==CL('.')) {
+            fmt++; prec = 0;
+            if(*fmt==CL('*')) {
+                prec = __builtin_va_arg(args, int);
+                if(prec < 0) prec = -1;
                 fmt++;
-            }
-            if(*fmt==CL('l')) fmt++;
-            if(*fmt==CL('c')) {
-                arg = __builtin_va_arg(args, int);
+            } else
+                for(; *fmt>=CL('0') && *fmt<=CL('9'); fmt++) prec = prec * 10 + *fmt - CL('0');
+        }
+        size = 0;
+        switch(*fmt) {
+            case CL('h'): fmt++; size = 2; if(*fmt==CL('h')) { fmt++; size = 1; } break;
+            case CL('l'): fmt++; size = 3; if(*fmt==CL('l')) { fmt++; size = 4; } break;
+            case CL('L'): fmt++; size = 5; break;
+            case CL('j'): case CL('z'): case CL('t'): fmt++; size = 4; break;
+            default: break;
+        }
+        if(!*fmt) break;
+        len = 0; p = tmpstr;
+        switch(*fmt) {
+            case CL('%'):
+                goto put;
+
+            case CL('c'):
+                arg = (uint64_t)__builtin_va_arg(args, int);
 #if USE_UTF8
-                if(arg<0x80) { *dst++ = arg; } else
-                if(arg<0x800) { *dst++ = ((arg>>6)&0x1F)|0xC0; *dst++ = (arg&0x3F)|0x80; } else
-                { *dst++ = ((arg>>12)&0x0F)|0xE0; *dst++ = ((arg>>6)&0x3F)|0x80; *dst++ = (arg&0x3F)|0x80; }
+                if(arg<0x80) { tmpstr[len++] = arg; } else
+                if(arg<0x800) { tmpstr[len++] = ((arg>>6)&0x1F)|0xC0; tmpstr[len++] = (arg&0x3F)|0x80; } else
+                { tmpstr[len++] = ((arg>>12)&0x0F)|0xE0; tmpstr[len++] = ((arg>>6)&0x3F)|0x80; tmpstr[len++] = (arg&0x3F)|0x80; }
 #else
-                *dst++ = (wchar_t)(arg & 0xffff);
+                tmpstr[len++] = (wchar_t)(arg & 0xffff);
 #endif
-                fmt++;
-                continue;
-            } else
-            if(*fmt==CL('d')) {
-                arg = __builtin_va_arg(args, int);
-                sign=0;
-                if((int)arg<0) {
-                    arg*=-1;
-                    sign++;
+                width -= len;
+                if(!(flags & __FMT_LEFT)) pad(CL(' '), width);
+                for(i = 0; i < len; i++) out(tmpstr[i]);
+                pad(CL(' '), width);
+                break;
+
+            case CL('d'): case CL('i'):
+                switch(size) {
+                    case 1: sarg = (signed char)__builtin_va_arg(args, int); break;
+                    case 2: sarg = (short)__builtin_va_arg(args, int); break;
+                    case 3: sarg = __builtin_va_arg(args, long int); break;
+                    case 4: case 5: sarg = __builtin_va_arg(args, int64_t); break;
+                    default: sarg = __builtin_va_arg(args, int); break;
                 }
-                if(arg>99999999999999999L) {
-                    arg=99999999999999999L;
+                if(sarg < 0) { arg = -(uint64_t)sarg; prefix[len++] = CL('-'); } else {
+                    arg = (uint64_t)sarg;
+                    if(flags & __FMT_PLUS) prefix[len++] = CL('+'); else
+                    if(flags & __FMT_SPACE) prefix[len++] = CL(' ');
                 }
-                i=18;
-                tmpstr[i]=0;
-                do {
-                    tmpstr[--i]=CL('0')+(arg%10);
-                    arg/=10;
-                } while(arg!=0 && i>0);
-                if(sign) {
-                    tmpstr[--i]=CL('-');
+                i = 10;
+                goto integer;
+
+            case CL('p'):
+                arg = (uintptr_t)__builtin_va_arg(args, void*);
+                /* pointers are always printed with all their digits */
+                if(prec < 0) prec = 16;
+                i = 16;
+                goto integer;
+
+            case CL('u'): case CL('x'): case CL('X'): case CL('o'):
+                switch(size) {
+                    case 1: arg = (unsigned char)__builtin_va_arg(args, unsigned int); break;
+                    case 2: arg = (unsigned short)__builtin_va_arg(args, unsigned int); break;
+                    case 3: arg = __builtin_va_arg(args, unsigned long int); break;
+                    case 4: case 5: arg = __builtin_va_arg(args, uint64_t); break;
+                    default: arg = __builtin_va_arg(args, unsigned int); break;
                 }
-                if(len>0 && len<18) {
-                    while(i>18-len) {
-                        tmpstr[--i]=pad;
-                    }
+                i = *fmt==CL('u') ? 10 : (*fmt==CL('o') ? 8 : 16);
+                if((flags & __FMT_ALT) && arg && i == 16) { prefix[len++] = CL('0'); prefix[len++] = *fmt; }
+integer:        p = tmpstr + sizeof(tmpstr) / sizeof(char_t);
+                /* precision 0 and value 0 prints no digits */
+                if(arg || prec) p = __fmt_utoa(p, arg, i, *fmt==CL('X'));
+                j = (int)(tmpstr + sizeof(tmpstr) / sizeof(char_t) - p);
+                if((flags & __FMT_ALT) && i == 8 && (!j || *p != CL('0'))) { *--p = CL('0'); j++; }
+                /* leading zeros from the precision, or from the zero flag if there's no precision */
+                prec = prec >= 0 ? prec - j : ((flags & (__FMT_ZERO | __FMT_LEFT)) == __FMT_ZERO ? width - len - j : 0);
+                if(prec < 0) prec = 0;
+                width -= len + prec + j;
+                if(!(flags & __FMT_LEFT)) pad(CL(' '), width);
+                for(i = 0; i < len; i++) out(prefix[i]);
+                pad(CL('0'), prec);
+                for(; j > 0; j--, p++) out(*p);
+                pad(CL(' '), width);
+                break;
+
+            case CL('e'): case CL('E'): case CL('f'): case CL('F'): case CL('g'): case CL('G'):
+                dbl.d = size == 5 ? __fmt_ldbl(__builtin_va_arg(args, long double)) : __builtin_va_arg(args, double);
+                if(dbl.u >> 63) prefix[len++] = CL('-'); else
+                if(flags & __FMT_PLUS) prefix[len++] = CL('+'); else
+                if(flags & __FMT_SPACE) prefix[len++] = CL(' ');
+                /* upper case conversions have upper case letters in the output */
+                n = *fmt <= CL('G') ? *fmt + CL('a') - CL('A') : *fmt;
+                arg = dbl.u & ((1ULL << 52) - 1);
+                e = (int)((dbl.u >> 52) & 0x7ff);
+                if(e == 0x7ff) {
+                    p = arg ? (*fmt <= CL('G') ? CL("NAN") : CL("nan")) : (*fmt <= CL('G') ? CL("INF") : CL("inf"));
+                    width -= len + 3;
+                    if(!(flags & __FMT_LEFT)) pad(CL(' '), width);
+                    for(i = 0; i < len; i++) out(prefix[i]);
+                    for(i = 0; i < 3; i++) out(p[i]);
+                    pad(CL(' '), width);
+                    break;
                 }
-                p=&tmpstr[i];
-                goto copystring;
-            } else
-            if(*fmt==CL('p')) {
-                arg = __builtin_va_arg(args, uint64_t);
-                len = 16; pad = CL('0'); goto hex;
-            } else
-            if(*fmt==CL('x') || *fmt==CL('X')) {
-                arg = __builtin_va_arg(args, long int);
-hex:            i=16;
-                tmpstr[i]=0;
-                do {
-                    n=arg & 0xf;
-                    /* 0-9 => '0'-'9', 10-15 => 'A'-'F' */
-                    tmpstr[--i]=n+(n>9?(*fmt==CL('X')?0x37:0x57):0x30);
-                    arg>>=4;
-                } while(arg!=0 && i>0);
-                /* padding, only leading zeros */
-                if(len>0 && len<=16) {
-                    while(i>16-len) {
-                        tmpstr[--i]=CL('0');
+                if(e) arg |= 1ULL << 52; else e = 1;
+                e -= 1075;
+                if(prec < 0) prec = 6;
+                if(n == CL('g')) {
+                    /* like %e with prec - 1, or like %f if the exponent isn't too small or too big */
+                    if(!prec) prec = 1;
+                    j = __fmt_dtoa(arg, e, prec, 0, dig, &x);
+                    if(x < prec && x >= -4) { n = CL('f'); prec -= x + 1; } else { n = CL('e'); prec--; }
+                    /* no trailing zeros unless the alternate form is requested */
+                    if(!(flags & __FMT_ALT)) {
+                        i = n == CL('f') ? j - x - 1 : j - 1;
+                        if(prec > i) prec = i < 0 ? 0 : i;
                     }
+                } else {
+                    j = __fmt_dtoa(arg, e, n == CL('f') ? prec : prec + 1, n == CL('f'), dig, &x);
                 }
-                p=&tmpstr[i];
-                goto copystring;
-            } else
-            if(*fmt==CL('s') || *fmt==CL('q')) {
+                /* the length of the output without the padding, e counts the digits before the point */
+                e = n == CL('f') ? (x < 0 ? 1 : x + 1) : 1;
+                i = e + (prec || (flags & __FMT_ALT) ? prec + 1 : 0) + (n == CL('e') ? (x <= -100 || x >= 100 ? 5 : 4) : 0);
+                width -= len + i;
+                if(!(flags & (__FMT_LEFT | __FMT_ZERO))) pad(CL(' '), width);
+                for(i = 0; i < len; i++) out(prefix[i]);
+                if(!(flags & __FMT_LEFT)) pad(CL('0'), width);
+                /* digits of the integer part, then the fraction. i is the position of the digit in dig */
+                i = n == CL('f') && x < 0 ? -1 : 0;
+                for(; e > 0; e--, i++) out(i >= 0 && i < j ? (char_t)dig[i] : CL('0'));
+                if(prec || (flags & __FMT_ALT)) out(CL('.'));
+                if(n == CL('f') && x < 0) i = x + 1;
+                for(; prec > 0; prec--, i++) out(i >= 0 && i < j ? (char_t)dig[i] : CL('0'));
+                if(n == CL('e')) {
+                    out(*fmt <= CL('G') ? CL('E') : CL('e'));
+                    out(x < 0 ? CL('-') : CL('+'));
+                    if(x < 0) x = -x;
+                    if(x >= 100) { out((char_t)(CL('0') + x / 100)); x %= 100; }
+                    out((char_t)(CL('0') + x / 10));
+                    out((char_t)(CL('0') + x % 10));
+                }
+                pad(CL(' '), width);
+                break;
+
+            case CL('s'): case CL('q'):
                 p = __builtin_va_arg(args, char_t*);
-copystring:     if(p==NULL) {
+                if(p==NULL) {
                     p=CL("(null)");
                 }
-                while(*p && dst + 2 < end) {
+                /* the number of characters to print, and the width of the output for padding */
+                for(i = j = 0; p[i] && (prec < 0 || j < prec); i++)
+                    j += *fmt==CL('q') && needsescape(p[i]) ? 2 : 1;
+                if(prec >= 0 && j > prec) { i--; j -= 2; }
+                width -= j;
+                if(!(flags & __FMT_LEFT)) pad(CL(' '), width);
+                for(; i > 0; i--, p++) {
                     if(*fmt==CL('q') && needsescape(*p)) {
-                        *dst++ = CL('\\');
+                        out(CL('\\'));
                         switch(*p) {
-                            case CL('\a'): *dst++ = CL('a'); break;
-                            case CL('\b'): *dst++ = CL('b'); break;
-                            case 27:       *dst++ = CL('e'); break; /* gcc 10.2 doesn't like CL('\e') in ansi mode */
-                            case CL('\f'): *dst++ = CL('f'); break;
-                            case CL('\n'): *dst++ = CL('n'); break;
-                            case CL('\r'): *dst++ = CL('r'); break;
-                            case CL('\t'): *dst++ = CL('t'); break;
-                            case CL('\v'): *dst++ = CL('v'); break;
-                            default: *dst++ = *p++; break;
+                            case CL('\a'): out(CL('a')); break;
+                            case CL('\b'): out(CL('b')); break;
+                            case 27:       out(CL('e')); break; /* gcc 10.2 doesn't like CL('\e') in ansi mode */
+                            case CL('\f'): out(CL('f')); break;
+                            case CL('\n'): out(CL('n')); break;
+                            case CL('\r'): out(CL('r')); break;
+                            case CL('\t'): out(CL('t')); break;
+                            case CL('\v'): out(CL('v')); break;
+                            default: out(*p); break;
                         }
                     } else {
-                        if(*p == CL('\n') && (orig == dst || *(dst - 1) != CL('\r'))) *dst++ = CL('\r');
-                        *dst++ = *p++;
+                        if(*p == CL('\n') && o->last != CL('\r')) out(CL('\r'));
+                        out(*p);
                     }
                 }
-            } else
+                pad(CL(' '), width);
+                break;
+
 #if !defined(USE_UTF8) || !USE_UTF8
-            if(*fmt==L'S' || *fmt==L'Q') {
+            case L'S': case L'Q':
                 c = __builtin_va_arg(args, char*);
-                if(c==NULL) goto copystring;
-                while(*p && dst + 2 < end) {
+                if(c==NULL) c = "(null)";
+                for(; *c; c++) {
                     arg = *c;
                     if((*c & 128) != 0) {
                         if((*c & 32) == 0 ) {
@@ -595,59 +2922,71 @@ copystring:     if(p==NULL) {
                     }
                     if(!arg) break;
                     if(*fmt==L'Q' && needsescape(arg)) {
-                        *dst++ = L'\\';
+                        out(L'\\');
                         switch(arg) {
-                            case L'\a': *dst++ = L'a'; break;
-                            case L'\b': *dst++ = L'b'; break;
-                            case 27:    *dst++ = L'e'; break;   /* gcc 10.2 doesn't like L'\e' in ansi mode */
-                            case L'\f': *dst++ = L'f'; break;
-                            case L'\n': *dst++ = L'n'; break;
-                            case L'\r': *dst++ = L'r'; break;
-                            case L'\t': *dst++ = L't'; break;
-                            case L'\v': *dst++ = L'v'; break;
-                            default: *dst++ = arg; break;
+                            case L'\a': out(L'a'); break;
+                            case L'\b': out(L'b'); break;
+                            case 27:    out(L'e'); break;   /* gcc 10.2 doesn't like L'\e' in ansi mode */
+                            case L'\f': out(L'f'); break;
+                            case L'\n': out(L'n'); break;
+                            case L'\r': out(L'r'); break;
+                            case L'\t': out(L't'); break;
+                            case L'\v': out(L'v'); break;
+                            default: out(arg); break;
                         }
                     } else {
-                        if(arg == L'\n') *dst++ = L'\r';
-                        *dst++ = (wchar_t)(arg & 0xffff);
+                        if(arg == L'\n' && o->last != L'\r') out(L'\r');
+                        out((wchar_t)(arg & 0xffff));
                     }
                 }
-            } else
+                break;
 #endif
-            if(*fmt==CL('D')) {
+
+            case CL('D'):
                 m = __builtin_va_arg(args, efi_physical_address_t);
-                for(j = 0; j < (len < 1 ? 1 : (len > 16 ? 16 : len)); j++) {
+                for(j = 0; j < (width < 1 ? 1 : width); j++) {
                     for(i = 44; i >= 0; i -= 4) {
-                        n = (m >> i) & 15; *dst++ = n + (n>9?0x37:0x30);
-                        if(dst >= end) goto zro;
+                        out((char_t)__fmt_hex[16 + ((m >> i) & 15)]);
                     }
-                    *dst++ = CL(':'); if(dst >= end) goto zro;
-                    *dst++ = CL(' '); if(dst >= end) goto zro;
+                    out(CL(':'));
+                    out(CL(' '));
                     mem = (uint8_t*)m;
                     for(i = 0; i < 16; i++) {
-                        n = (mem[i] >> 4) & 15; *dst++ = n + (n>9?0x37:0x30); if(dst >= end) goto zro;
-                        n = mem[i] & 15; *dst++ = n + (n>9?0x37:0x30); if(dst >= end) goto zro;
-                        *dst++ = CL(' ');if(dst >= end) goto zro;
+                        out((char_t)__fmt_hex[16 + (mem[i] >> 4)]);
+                        out((char_t)__fmt_hex[16 + (mem[i] & 15)]);
+                        out(CL(' '));
                     }
-                    *dst++ = CL(' '); if(dst >= end) goto zro;
+                    out(CL(' '));
                     for(i = 0; i < 16; i++) {
-                        *dst++ = (mem[i] < 32 || mem[i] >= 127 ? CL('.') : mem[i]);
-                        if(dst >= end) goto zro;
+                        n = mem[i] < 32 || mem[i] >= 127 ? CL('.') : mem[i];
+                        out(n);
                     }
-                    *dst++ = CL('\r'); if(dst >= end) goto zro;
-                    *dst++ = CL('\n'); if(dst >= end) goto zro;
+                    out(CL('\r'));
+                    out(CL('\n'));
                     m += 16;
                 }
-            }
-        } else {
-put:        if(*fmt == CL('\n') && (orig == dst || *(dst - 1) != CL('\r'))) *dst++ = CL('\r');
-            *dst++ = *fmt;
+                break;
+
+            default:
+                break;
         }
         fmt++;
     }
-zro:*dst=0;
-    return dst-orig;
+    __fmt_flush(o);
+zro:*o->dst=0;
+    return o->total + (int)(o->dst - o->buf);
 #undef needsescape
+#undef pad
+#undef out
+}
+
+int vsnprintf(char_t *dst, size_t maxlen, const char_t *fmt, __builtin_va_list args)
+{
+    __fmt_t o;
+    if(dst==NULL || fmt==NULL || maxlen < 1)
+        return 0;
+    o.buf = o.dst = dst; o.end = dst + maxlen - 1; o.last = 0; o.total = 0; o.sink = NULL; o.ctx = NULL;
+    return __vformat(&o, fmt, args);
 }
 
 int vsprintf(char_t *dst, const char_t *fmt, __builtin_va_list args)
@@ -671,17 +3010,7 @@ int snprintf(char_t *dst, size_t maxlen, const char_t* fmt, ...)
 
 int vprintf(const char_t* fmt, __builtin_va_list args)
 {
-    int ret;
-    wchar_t dst[BUFSIZ];
-#if USE_UTF8
-    char_t tmp[BUFSIZ];
-    ret = vsnprintf(tmp, BUFSIZ, fmt, args);
-    mbstowcs(dst, tmp, BUFSIZ - 1);
-#else
-    ret = vsnprintf(dst, BUFSIZ, fmt, args);
-#endif
-    ST->ConOut->OutputString(ST->ConOut, (wchar_t *)&dst);
-    return ret;
+    return vfprintf(stdout, fmt, args);
 }
 
 int printf(const char_t* fmt, ...)
@@ -693,37 +3022,14 @@ int printf(const char_t* fmt, ...)
 
 int vfprintf (FILE *__stream, const char_t *__format, __builtin_va_list args)
 {
-    wchar_t dst[BUFSIZ];
-    char_t tmp[BUFSIZ];
-    uintn_t ret, i;
-#if USE_UTF8
-    ret = vsnprintf(tmp, BUFSIZ, __format, args);
-    ret = mbstowcs(dst, tmp, BUFSIZ - 1);
-#else
-    ret = vsnprintf(dst, BUFSIZ, __format, args);
-#endif
-    if(ret < 1 || __stream == stdin) return 0;
-    for(i = 0; i < __blk_ndevs; i++)
-        if(__stream == (FILE*)__blk_devs[i].bio) {
-            errno = EBADF;
-            return -1;
-        }
-    if(__stream == stdout)
-        ST->ConOut->OutputString(ST->ConOut, (wchar_t*)&dst);
-    else if(__stream == stderr)
-        ST->StdErr->OutputString(ST->StdErr, (wchar_t*)&dst);
-    else if(__ser && __stream == (FILE*)__ser) {
-#if !defined(USE_UTF8) || !USE_UTF8
-        wcstombs((char*)&tmp, dst, BUFSIZ - 1);
-#endif
-        __ser->Write(__ser, &ret, (void*)&tmp);
-    } else
-#if USE_UTF8
-        __stream->Write(__stream, &ret, (void*)&tmp);
-#else
-        __stream->Write(__stream, &ret, (void*)&dst);
-#endif
-    return ret;
+    __fmt_t o;
+    char_t chunk[__FMTCHUNK + 1];
+    if(!__stream || !__stream->type || __stream->type == __FT_BLK || __stream == stdin) {
+        errno = EBADF;
+        return -1;
+    }
+    o.buf = o.dst = chunk; o.end = chunk + __FMTCHUNK; o.last = 0; o.total = 0; o.sink = __fmt_stream; o.ctx = __stream;
+    return __vformat(&o, __format, args);
 }
 
 int fprintf (FILE *__stream, const char_t *__format, ...)
@@ -733,10 +3039,39 @@ int fprintf (FILE *__stream, const char_t *__format, ...)
     return vfprintf(__stream, __format, args);
 }
 
+int fputs (const char_t *__s, FILE *__stream)
+{
+    const char_t *e;
+    if(!__stream || !__stream->type || __stream->type == __FT_BLK || __stream == stdin) {
+        errno = EBADF;
+        return EOF;
+    }
+    if(!__s) {
+        errno = EINVAL;
+        return EOF;
+    }
+    /* no format parsing, but for serial a wide string has to be converted */
+#if !defined(USE_UTF8) || !USE_UTF8
+    if(__stream->type == __FT_SER)
+        return fprintf(__stream, CL("%s"), __s) < 0 ? EOF : 1;
+#endif
+    for(e = __s; *e; e++);
+    if(e == __s) return 1;
+    return __stream->ops->write(__stream, __s, (e - __s) * sizeof(char_t)) == (e - __s) * sizeof(char_t) ? 1 : EOF;
+}
+
+int puts (const char_t *__s)
+{
+    if(fputs(__s, stdout) == EOF) return EOF;
+    return fputs(CL("\n"), stdout);
+}
+
 int getchar (void)
 {
     efi_input_key_t key;
-    efi_status_t status = ST->ConIn->ReadKeyStroke(ST->ConIn, &key);
+    efi_status_t status;
+    fflush(stdout);
+    status = ST->ConIn->ReadKeyStroke(ST->ConIn, &key);
     return EFI_ERROR(status) ? -1 : key.UnicodeChar;
 
 }
@@ -744,7 +3079,9 @@ int getchar (void)
 int getchar_ifany (void)
 {
     efi_input_key_t key;
-    efi_status_t status = BS->CheckEvent(ST->ConIn->WaitForKey);
+    efi_status_t status;
+    fflush(stdout);
+    status = BS->CheckEvent(ST->ConIn->WaitForKey);
     if(!status) {
         status = ST->ConIn->ReadKeyStroke(ST->ConIn, &key);
         return EFI_ERROR(status) ? -1 : key.UnicodeChar;
@@ -754,9 +3091,225 @@ int getchar_ifany (void)
 
 int putchar (int __c)
 {
-    wchar_t tmp[2];
-    tmp[0] = (wchar_t)__c;
-    tmp[1] = 0;
-    ST->ConOut->OutputString(ST->ConOut, (__c == L'\n' ? (wchar_t*)L"\r\n" : (wchar_t*)&tmp));
-    return (int)tmp[0];
+    __con_put(stdout, (wchar_t)__c);
+    if((stdout->flags & __FF_NBF) || (__c == L'\n' && (stdout->flags & __FF_LBF))) __con_flush(stdout);
+    return (int)(wchar_t)__c;
+}
+
+int setvbuf (FILE *__stream, char *__buf, int __modes, size_t __n)
+{
+    if(!__stream || !__stream->type) {
+        errno = EBADF;
+        return -1;
+    }
+    if(__modes != _IOFBF && __modes != _IOLBF && __modes != _IONBF) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* serial streams have a receive ring, unbuffered turns it off */
+    if(__stream->type == __FT_SER && __stream->ops != &__uart_ops) {
+        if(__stream->flags & __FF_FREEBUF) free(__stream->buf);
+        __stream->flags &= ~__FF_FREEBUF;
+        __stream->buf = NULL;
+        __stream->bufsiz = __stream->buflen = 0;
+        __stream->offset = 0;
+        if(__modes == _IONBF || !__n) return 0;
+        if(!__buf) {
+            if(!(__buf = malloc(__n))) return -1;
+            __stream->flags |= __FF_FREEBUF;
+        }
+        __stream->buf = __buf;
+        __stream->bufsiz = __n;
+        return 0;
+    }
+    /* only console output is buffered, everything else goes straight to the firmware */
+    if(__stream->type != __FT_CON || __stream == stdin) return 0;
+    fflush(__stream);
+    __stream->flags &= ~(__FF_LBF | __FF_NBF);
+    __stream->flags |= __modes == _IOLBF ? __FF_LBF : (__modes == _IONBF ? __FF_NBF : 0);
+    if(__buf && __n >= 4 * sizeof(wchar_t)) {
+        __stream->buf = __buf;
+        __stream->bufsiz = __n / sizeof(wchar_t);
+    } else if(!__buf && __stream->buf != __con_buf[__stream - stdout]) {
+        __stream->buf = __con_buf[__stream - stdout];
+        __stream->bufsiz = __CONBUFSIZ;
+    }
+    return 0;
+}
+
+void setbuf (FILE *__stream, char *__buf)
+{
+    setvbuf(__stream, __buf, __buf ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+int serctl (FILE *__stream, int __req, uintn_t __val)
+{
+    efi_serial_io_protocol_t *ser;
+    efi_serial_io_mode_t *m;
+    efi_status_t status;
+    uint64_t baud;
+    uint32_t fifo, tmo;
+    if(!__stream || __stream->type != __FT_SER) {
+        errno = ENOTTY;
+        return -1;
+    }
+    if(__req == SER_NONBLOCK) {
+        if(__val) __stream->flags |= __FF_NONBLOCK;
+        else __stream->flags &= ~__FF_NONBLOCK;
+        return 0;
+    }
+    /* the directly driven UART has no FIFO or timeout settings */
+    if(__stream->ops == &__uart_ops) {
+        if(__req == SER_BAUD) __uart_baud(__val);
+        return 0;
+    }
+    ser = __stream->h.ser;
+    m = ser->Mode;
+    baud = m->BaudRate; fifo = m->ReceiveFifoDepth; tmo = m->Timeout;
+    switch(__req) {
+        case SER_BAUD: baud = __val; break;
+        case SER_FIFO: fifo = (uint32_t)__val; break;
+        case SER_TIMEOUT: tmo = (uint32_t)__val; break;
+        default: errno = EINVAL; return -1;
+    }
+    status = ser->SetAttributes(ser, baud, fifo, tmo, (efi_parity_type_t)m->Parity, (uint8_t)m->DataBits,
+        (efi_stop_bits_type_t)m->StopBits);
+    if(EFI_ERROR(status)) {
+        __stdio_seterrno(status);
+        return -1;
+    }
+    return 0;
+}
+
+/*** copying between streams ***/
+static int __copy_seekable (FILE *f)
+{
+    return f->type == __FT_BLK || f->type == __FT_FILE || f->type == __FT_MEM;
+}
+
+/* start a transfer, through aio for streams that support it, synchronously for the console and serial */
+static int __copy_io (struct aiocb *cb, void *buf, off_t off, size_t n, int wr)
+{
+    cb->aio_buf = buf;
+    cb->aio_offset = off;
+    cb->aio_nbytes = n;
+    if(__copy_seekable(cb->aio_fildes)) return __aio_submit(cb, wr);
+    cb->__token.BufferSize = wr ? fwrite(buf, 1, n, cb->aio_fildes) : fread(buf, 1, n, cb->aio_fildes);
+    return 0;
+}
+
+static ssize_t __copy_wait (struct aiocb *cb)
+{
+    const struct aiocb *list[1];
+    if(!__copy_seekable(cb->aio_fildes)) return (ssize_t)cb->__token.BufferSize;
+    list[0] = cb;
+    aio_suspend(list, 1, NULL);
+    return aio_return(cb);
+}
+
+/**
+ * Copy between any two streams with two large buffers, reading the next chunk while the previous one is written
+ * (asynchronously if the firmware supports ReadEx / WriteEx or Block IO 2, otherwise still in large transfers).
+ * Uses FILE* instead of fds, and __flags is unused.
+ */
+ssize_t copy_file_range (FILE *__in, off_t *__off_in, FILE *__out, off_t *__off_out, size_t __len, unsigned int __flags)
+{
+    struct aiocb rd, wr;
+    efi_status_t status;
+    efi_block_io_media_t *media;
+    uint8_t *mem, *buf[2], *tail;
+    size_t chunk, blk = 1, align = 1, total = 0, left = __len, wlen = 0, ob;
+    ssize_t n, m;
+    off_t pin, pout, pin0, pout0;
+    int cur = 0, rdp = 0, wrp = 0, err = 0;
+    (void)__flags;
+    if(!__in || !__in->type || !__out || !__out->type) {
+        errno = EBADF;
+        return -1;
+    }
+    if(!__len) return 0;
+    /* whole blocks, aligned as the devices require */
+    if(__in->type == __FT_BLK) {
+        media = __in->h.bio->Media;
+        if(media->BlockSize > blk) blk = media->BlockSize;
+        if(media->IoAlign > align) align = media->IoAlign;
+    }
+    if(__out->type == __FT_BLK) {
+        media = __out->h.bio->Media;
+        if(__off_out && *__off_out % media->BlockSize) {
+            errno = EINVAL;
+            return -1;
+        }
+        if(media->BlockSize > blk) blk = media->BlockSize;
+        if(media->IoAlign > align) align = media->IoAlign;
+    }
+    chunk = __COPYBUFSIZ > blk ? __COPYBUFSIZ / blk * blk : blk;
+    if(__len < chunk) chunk = (__len + blk - 1) / blk * blk;
+    if(!(mem = (uint8_t*)malloc(2 * chunk + blk + align))) return -1;
+    buf[0] = (uint8_t*)(((uintptr_t)mem + align - 1) & ~((uintptr_t)align - 1));
+    buf[1] = buf[0] + chunk;
+    tail = buf[1] + chunk;
+    memset(&rd, 0, sizeof(struct aiocb));
+    memset(&wr, 0, sizeof(struct aiocb));
+    rd.aio_fildes = __in;
+    wr.aio_fildes = __out;
+    /* aio moves the file handles' positions, so remember where the streams were */
+    pin0 = pin = __off_in ? *__off_in : (__copy_seekable(__in) ? __in->ops->tell(__in) : 0);
+    pout0 = pout = __off_out ? *__off_out : (__copy_seekable(__out) ? __out->ops->tell(__out) : 0);
+    /* create the completion events once instead of on every transfer */
+    if(__copy_seekable(__in) && EFI_ERROR((status = BS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &rd.aio_event)))) goto everr;
+    if(__copy_seekable(__out) && EFI_ERROR((status = BS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &wr.aio_event)))) {
+everr:  __stdio_seterrno(status);
+        err = 1;
+        goto end;
+    }
+    if(__copy_io(&rd, buf[0], pin, left < chunk ? left : chunk, 0)) { err = 1; goto end; }
+    rdp = 1;
+    while(rdp) {
+        n = __copy_wait(&rd);
+        rdp = 0;
+        if(n <= 0) { err = n < 0; break; }
+        pin += n;
+        left -= n;
+        if(wrp) {
+            m = __copy_wait(&wr);
+            wrp = 0;
+            if(m > 0) total += (size_t)m < wlen ? (size_t)m : wlen;
+            if(m != (ssize_t)wr.aio_nbytes) { err = m < 0; break; }
+        }
+        /* read the next chunk into the other buffer while this one is written */
+        /* disks are written in whole blocks, so fill up a partial last one with what's already on the disk. A short
+         * read means the end of the input, nothing else could be written after that block anyway */
+        wlen = (size_t)n;
+        if(__out->type == __FT_BLK && (ob = __out->h.bio->Media->BlockSize) && n % ob) {
+            media = __out->h.bio->Media;
+            status = __out->h.bio->ReadBlocks(__out->h.bio, media->MediaId, (pout + n) / ob, ob, tail);
+            if(EFI_ERROR(status)) { __stdio_seterrno(status); err = 1; break; }
+            memcpy(buf[cur] + n, tail + n % ob, ob - n % ob);
+            n += ob - n % ob;
+            left = 0;
+        }
+        if(left && !__copy_io(&rd, buf[cur ^ 1], pin, left < chunk ? left : chunk, 0)) rdp = 1;
+        if(__copy_io(&wr, buf[cur], pout, n, 1)) { err = 1; break; }
+        wrp = 1;
+        pout += n;
+        cur ^= 1;
+    }
+    /* buffers can't be freed while the firmware is still using them */
+    if(rdp) __copy_wait(&rd);
+    if(wrp && (m = __copy_wait(&wr)) > 0) total += (size_t)m < wlen ? (size_t)m : wlen;
+end:
+    if(rd.aio_event) BS->CloseEvent(rd.aio_event);
+    if(wr.aio_event) BS->CloseEvent(wr.aio_event);
+    free(mem);
+    if(__off_in) *__off_in = pin0 + total;
+    else if(__copy_seekable(__in)) __in->ops->seek(__in, pin0 + total, SEEK_SET);
+    if(__off_out) *__off_out = pout0 + total;
+    else if(__copy_seekable(__out)) __out->ops->seek(__out, pout0 + total, SEEK_SET);
+    return err && !total ? -1 : (ssize_t)total;
+}
+
+ssize_t sendfile (FILE *__out, FILE *__in, off_t *__offset, size_t __count)
+{
+    return copy_file_range(__in, __offset, __out, NULL, __count, 0);
 }
@@ -84,9 +84,12 @@ void *malloc (size_t __size)
      * too, because realloc won't work otherwise... Why can't AllocatePool accept input addresses? */
     for(i = 0; i < __stdlib_numallocs && __stdlib_allocs[i] != 0; i += 2);
     if(i == __stdlib_numallocs) {
-        status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, __stdlib_numallocs + 2, &ret);
+        status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, (__stdlib_numallocs + 2) * sizeof(uintptr_t), &ret);
         if(EFI_ERROR(status) || !ret) { errno = ENOMEM; return NULL; }
-        if(__stdlib_allocs) memcpy(ret, __stdlib_allocs, __stdlib_numallocs * sizeof(uintptr_t));
+        if(__stdlib_allocs) {
+            memcpy(ret, __stdlib_allocs, __stdlib_numallocs * sizeof(uintptr_t));
+            BS->FreePool(__stdlib_allocs);
+        }
         __stdlib_allocs = (uintptr_t*)ret;
         __stdlib_allocs[i] = __stdlib_allocs[i + 1] = 0;
         __stdlib_numallocs += 2;
@@ -115,11 +118,10 @@ void *realloc (void *__ptr, size_t __size)
     for(i = 0; i < __stdlib_numallocs && __stdlib_allocs[i] != (uintptr_t)__ptr; i += 2);
     if(i == __stdlib_numallocs) { errno = ENOMEM; return NULL; }
     status = BS->AllocatePool(LIP ? LIP->ImageDataType : EfiLoaderData, __size, &ret);
-    if(EFI_ERROR(status) || !ret) { errno = ENOMEM; ret = NULL; }
-    if(ret) {
-        memcpy(ret, (void*)__stdlib_allocs[i], __stdlib_allocs[i + 1] < __size ? __stdlib_allocs[i + 1] : __size);
-        if(__size > __stdlib_allocs[i + 1]) memset((uint8_t*)ret + __stdlib_allocs[i + 1], 0, __size - __stdlib_allocs[i + 1]);
-    }
+    /* on failure the original block is left intact */
+    if(EFI_ERROR(status) || !ret) { errno = ENOMEM; return NULL; }
+    memcpy(ret, (void*)__stdlib_allocs[i], __stdlib_allocs[i + 1] < __size ? __stdlib_allocs[i + 1] : __size);
+    if(__size > __stdlib_allocs[i + 1]) memset((uint8_t*)ret + __stdlib_allocs[i + 1], 0, __size - __stdlib_allocs[i + 1]);
     BS->FreePool((void*)__stdlib_allocs[i]);
     __stdlib_allocs[i] = (uintptr_t)ret;
     __stdlib_allocs[i + 1] = (uintptr_t)__size;
@@ -165,8 +165,7 @@ int strncmp(const char_t *s1, const char_t *s2, size_t n)
 {
     const char_t *e = s1+n;
     if(s1 && s2 && s1!=s2 && n>0) {
-        do{if(*s1!=*s2){return *s1-*s2;}s1++;s2++;}while(*s1!=0 && s1<e);
-        return *s1-*s2;
+        do{if(*s1!=*s2){return *s1-*s2;}s1++;s2++;}while(*(s1-1)!=0 && s1<e);
     }
     return 0;
 }
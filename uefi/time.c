@@ -83,7 +83,7 @@ uint64_t __year_to_secs(uint64_t year, int *is_leap)
 
 time_t __mktime_efi(efi_time_t *t)
 {
-    __tm.tm_year = t->Year + 98;
+    __tm.tm_year = t->Year - 1900;
     __tm.tm_mon = t->Month - 1;
     __tm.tm_mday = t->Day;
     __tm.tm_hour = t->Hour;
@@ -0,0 +1,374 @@
+/*
+ * tmpfs.c
+ *
+ * Copyright (C) 2021 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the POSIX-UEFI package.
+ * @brief Implementing the in-memory file system mounted on /tmp
+ *
+ */
+
+#include <uefi.h>
+
+/* The file system is served through an EFI_FILE_PROTOCOL of our own, so stdio, dirent and
+ * nftw use it exactly like a firmware volume. File data is kept in EFI pages which are only
+ * allocated when written, holes left by seeking past the end read as zeros. */
+
+typedef struct __tmpnode_s {
+    struct __tmpnode_s *parent, *child, *next;
+    wchar_t *name;
+    uint64_t attr, size;
+    efi_physical_address_t *pages;  /* one entry per EFI_PAGE_SIZE chunk, 0 if not allocated yet */
+    uintn_t npages;                 /* number of entries in pages, not the allocated ones */
+    uintn_t used;                   /* number of allocated pages */
+    efi_time_t ctime, mtime;
+    uintn_t refs;                   /* open handles */
+    int deleted;                    /* unlinked, freed when the last handle is closed */
+} __tmpnode_t;
+
+typedef struct {
+    efi_file_handle_t p;            /* must be the first */
+    __tmpnode_t *node;
+    uint64_t pos;                   /* byte offset for files, entry index for directories */
+    uint64_t mode;
+    int dirty;
+} __tmpfh_t;
+
+static __tmpnode_t __tmp_root;
+static __tmpfh_t __tmp_rootfh;
+
+static void __tmp_now (efi_time_t *t)
+{
+    memset(t, 0, sizeof(efi_time_t));
+    ST->RuntimeServices->GetTime(t, NULL);
+}
+
+/* compare a path component of n characters (not terminated) with a node's name, case insensitive */
+static int __tmp_namecmp (const wchar_t *a, const wchar_t *b, size_t n)
+{
+    wchar_t x, y;
+    for(; n; n--) {
+        x = *a++; y = *b++;
+        if(x >= L'a' && x <= L'z') x -= 32;
+        if(y >= L'a' && y <= L'z') y -= 32;
+        if(x != y || !x) return 1;
+    }
+    return *b != 0;
+}
+
+/* release pages from index from on */
+static void __tmp_trunc (__tmpnode_t *n, uintn_t from)
+{
+    uintn_t i;
+    for(i = from; i < n->npages; i++)
+        if(n->pages[i]) {
+            BS->FreePages(n->pages[i], 1);
+            n->pages[i] = 0;
+            n->used--;
+        }
+}
+
+static void __tmp_free (__tmpnode_t *n)
+{
+    __tmp_trunc(n, 0);
+    if(n->pages) free(n->pages);
+    free(n);
+}
+
+static void __tmp_unlink (__tmpnode_t *n)
+{
+    __tmpnode_t **l;
+    for(l = &n->parent->child; *l && *l != n; l = &(*l)->next);
+    if(*l) *l = n->next;
+    n->next = NULL;
+    n->deleted = 1;
+}
+
+static efi_status_t EFIAPI __tmp_open (efi_file_handle_t *File, efi_file_handle_t **NewHandle, wchar_t *FileName,
+    uint64_t OpenMode, uint64_t Attributes);
+
+static efi_status_t EFIAPI __tmp_close (efi_file_handle_t *File)
+{
+    __tmpfh_t *fh = (__tmpfh_t*)File;
+    __tmpnode_t *n = fh->node;
+    if(fh == &__tmp_rootfh) return EFI_SUCCESS;
+    if(fh->dirty) __tmp_now(&n->mtime);
+    if(!--n->refs && n->deleted) __tmp_free(n);
+    free(fh);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI __tmp_delete (efi_file_handle_t *File)
+{
+    __tmpfh_t *fh = (__tmpfh_t*)File;
+    __tmpnode_t *n = fh->node;
+    /* like the FAT driver, refuse handles that weren't opened for writing */
+    if(n == &__tmp_root || n->child || !(fh->mode & EFI_FILE_MODE_WRITE)) {
+        __tmp_close(File);
+        return EFI_WARN_DELETE_FAILURE;
+    }
+    if(!n->deleted) __tmp_unlink(n);
+    return __tmp_close(File);
+}
+
+/* directories return one file info record per call, like the firmware does */
+static efi_status_t __tmp_info (__tmpnode_t *n, uintn_t *BufferSize, void *Buffer)
+{
+    efi_file_info_t *info = (efi_file_info_t*)Buffer;
+    uintn_t len, siz;
+    for(len = 0; n->name[len]; len++);
+    siz = (uintn_t)((uint8_t*)&info->FileName[len + 1] - (uint8_t*)info);
+    if(*BufferSize < siz) {
+        *BufferSize = siz;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    info->Size = siz;
+    info->FileSize = n->size;
+    info->PhysicalSize = (uint64_t)n->used * EFI_PAGE_SIZE;
+    info->CreateTime = n->ctime;
+    info->LastAccessTime = n->mtime;
+    info->ModificationTime = n->mtime;
+    info->Attribute = n->attr;
+    memcpy(info->FileName, n->name, (len + 1) * sizeof(wchar_t));
+    *BufferSize = siz;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI __tmp_read (efi_file_handle_t *File, uintn_t *BufferSize, void *Buffer)
+{
+    __tmpfh_t *fh = (__tmpfh_t*)File;
+    __tmpnode_t *n = fh->node, *c;
+    uint64_t i, o, l, r;
+    efi_status_t status;
+    if(n->attr & EFI_FILE_DIRECTORY) {
+        for(c = n->child, i = 0; c && i < fh->pos; c = c->next, i++);
+        if(!c) { *BufferSize = 0; return EFI_SUCCESS; }
+        status = __tmp_info(c, BufferSize, Buffer);
+        if(!EFI_ERROR(status)) fh->pos++;
+        return status;
+    }
+    r = fh->pos < n->size ? n->size - fh->pos : 0;
+    if(r > *BufferSize) r = *BufferSize;
+    for(l = 0; l < r; l += o) {
+        i = (fh->pos + l) / EFI_PAGE_SIZE;
+        o = EFI_PAGE_SIZE - (fh->pos + l) % EFI_PAGE_SIZE;
+        if(o > r - l) o = r - l;
+        if(i < n->npages && n->pages[i])
+            memcpy((uint8_t*)Buffer + l, (uint8_t*)(uintptr_t)n->pages[i] + (fh->pos + l) % EFI_PAGE_SIZE, o);
+        else
+            memset((uint8_t*)Buffer + l, 0, o);
+    }
+    fh->pos += r;
+    *BufferSize = (uintn_t)r;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI __tmp_write (efi_file_handle_t *File, uintn_t *BufferSize, void *Buffer)
+{
+    __tmpfh_t *fh = (__tmpfh_t*)File;
+    __tmpnode_t *n = fh->node;
+    efi_physical_address_t *pages;
+    uint64_t i, o, l, w = *BufferSize;
+    uintn_t np;
+    efi_status_t status = EFI_SUCCESS;
+    if(n->attr & EFI_FILE_DIRECTORY) return EFI_UNSUPPORTED;
+    if(!(fh->mode & EFI_FILE_MODE_WRITE)) return EFI_ACCESS_DENIED;
+    if(!w) return EFI_SUCCESS;
+    np = (uintn_t)((fh->pos + w + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE);
+    if(np > n->npages) {
+        /* grow the page table geometrically, realloc zeroes the new entries */
+        if(np < n->npages * 2) np = n->npages * 2;
+        if(np < 16) np = 16;
+        if(!(pages = (efi_physical_address_t*)(n->pages ? realloc(n->pages, np * sizeof(efi_physical_address_t)) :
+            calloc(np, sizeof(efi_physical_address_t)))))
+            return EFI_VOLUME_FULL;
+        n->pages = pages;
+        n->npages = np;
+    }
+    for(l = 0; l < w; l += o) {
+        i = (fh->pos + l) / EFI_PAGE_SIZE;
+        o = EFI_PAGE_SIZE - (fh->pos + l) % EFI_PAGE_SIZE;
+        if(o > w - l) o = w - l;
+        if(!n->pages[i]) {
+            if(EFI_ERROR(BS->AllocatePages(AllocateAnyPages, LIP ? LIP->ImageDataType : EfiLoaderData, 1, &n->pages[i]))) {
+                n->pages[i] = 0;
+                status = EFI_VOLUME_FULL;
+                break;
+            }
+            n->used++;
+            if(o != EFI_PAGE_SIZE) memset((void*)(uintptr_t)n->pages[i], 0, EFI_PAGE_SIZE);
+        }
+        memcpy((uint8_t*)(uintptr_t)n->pages[i] + (fh->pos + l) % EFI_PAGE_SIZE, (uint8_t*)Buffer + l, o);
+    }
+    fh->pos += l;
+    if(fh->pos > n->size) n->size = fh->pos;
+    fh->dirty = 1;
+    *BufferSize = (uintn_t)l;
+    return status;
+}
+
+static efi_status_t EFIAPI __tmp_getpos (efi_file_handle_t *File, uint64_t *Position)
+{
+    __tmpfh_t *fh = (__tmpfh_t*)File;
+    if(fh->node->attr & EFI_FILE_DIRECTORY) return EFI_UNSUPPORTED;
+    *Position = fh->pos;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI __tmp_setpos (efi_file_handle_t *File, uint64_t Position)
+{
+    __tmpfh_t *fh = (__tmpfh_t*)File;
+    if(fh->node->attr & EFI_FILE_DIRECTORY) {
+        if(Position) return EFI_UNSUPPORTED;
+        fh->pos = 0;
+    } else
+        fh->pos = Position == ~(uint64_t)0 ? fh->node->size : Position;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI __tmp_getinfo (efi_file_handle_t *File, efi_guid_t *InformationType, uintn_t *BufferSize,
+    void *Buffer)
+{
+    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
+    if(memcmp(InformationType, &infGuid, sizeof(efi_guid_t))) return EFI_UNSUPPORTED;
+    return __tmp_info(((__tmpfh_t*)File)->node, BufferSize, Buffer);
+}
+
+/* only the size and the read-only attribute can be changed */
+static efi_status_t EFIAPI __tmp_setinfo (efi_file_handle_t *File, efi_guid_t *InformationType, uintn_t BufferSize,
+    void *Buffer)
+{
+    __tmpfh_t *fh = (__tmpfh_t*)File;
+    __tmpnode_t *n = fh->node;
+    efi_file_info_t *info = (efi_file_info_t*)Buffer;
+    efi_guid_t infGuid = EFI_FILE_INFO_GUID;
+    uintn_t p;
+    if(memcmp(InformationType, &infGuid, sizeof(efi_guid_t))) return EFI_UNSUPPORTED;
+    if(BufferSize < (uintn_t)((uint8_t*)&info->FileName - (uint8_t*)info)) return EFI_BAD_BUFFER_SIZE;
+    if((info->Attribute ^ n->attr) & EFI_FILE_DIRECTORY) return EFI_ACCESS_DENIED;
+    if(info->FileSize != n->size) {
+        if(n->attr & EFI_FILE_DIRECTORY) return EFI_ACCESS_DENIED;
+        if(!(fh->mode & EFI_FILE_MODE_WRITE)) return EFI_ACCESS_DENIED;
+        if(info->FileSize < n->size) {
+            /* drop whole pages past the end and clear the tail of the last one, so growing reads zeros */
+            p = (uintn_t)((info->FileSize + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE);
+            __tmp_trunc(n, p);
+            if((info->FileSize % EFI_PAGE_SIZE) && p - 1 < n->npages && n->pages[p - 1])
+                memset((uint8_t*)(uintptr_t)n->pages[p - 1] + info->FileSize % EFI_PAGE_SIZE, 0,
+                    EFI_PAGE_SIZE - info->FileSize % EFI_PAGE_SIZE);
+        }
+        n->size = info->FileSize;
+        fh->dirty = 1;
+    }
+    n->attr = (n->attr & ~EFI_FILE_READ_ONLY) | (info->Attribute & EFI_FILE_READ_ONLY);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI __tmp_flush (efi_file_handle_t *File)
+{
+    (void)File;
+    return EFI_SUCCESS;
+}
+
+static efi_file_handle_t __tmp_proto = {
+    EFI_FILE_PROTOCOL_REVISION, __tmp_open, __tmp_close, __tmp_delete, __tmp_read, __tmp_write,
+    __tmp_getpos, __tmp_setpos, __tmp_getinfo, __tmp_setinfo, __tmp_flush, NULL, NULL, NULL, NULL
+};
+
+static efi_status_t EFIAPI __tmp_open (efi_file_handle_t *File, efi_file_handle_t **NewHandle, wchar_t *FileName,
+    uint64_t OpenMode, uint64_t Attributes)
+{
+    __tmpnode_t *n = ((__tmpfh_t*)File)->node, *c, **l;
+    __tmpfh_t *fh;
+    wchar_t *s, *e;
+    size_t len;
+    if(!NewHandle || !FileName) return EFI_INVALID_PARAMETER;
+    if(*FileName == L'\\') n = &__tmp_root;
+    for(s = FileName; *s; s = e) {
+        while(*s == L'\\') s++;
+        for(e = s; *e && *e != L'\\'; e++);
+        len = (size_t)(e - s);
+        if(!len || (len == 1 && s[0] == L'.')) continue;
+        if(!(n->attr & EFI_FILE_DIRECTORY)) return EFI_NOT_FOUND;
+        if(len == 2 && s[0] == L'.' && s[1] == L'.') {
+            if(n->parent) n = n->parent;
+            continue;
+        }
+        for(l = &n->child; *l && __tmp_namecmp(s, (*l)->name, len); l = &(*l)->next);
+        if(*l) { n = *l; continue; }
+        while(*e == L'\\') e++;
+        if(*e || !(OpenMode & EFI_FILE_MODE_CREATE) || n->deleted) return EFI_NOT_FOUND;
+        if(len >= FILENAME_MAX) return EFI_INVALID_PARAMETER;
+        /* new entries are appended, so a directory being read sees each entry once */
+        if(!(c = (__tmpnode_t*)malloc(sizeof(__tmpnode_t) + (len + 1) * sizeof(wchar_t)))) return EFI_OUT_OF_RESOURCES;
+        memset(c, 0, sizeof(__tmpnode_t));
+        c->name = (wchar_t*)(c + 1);
+        memcpy(c->name, s, len * sizeof(wchar_t));
+        c->name[len] = 0;
+        c->attr = (Attributes & EFI_FILE_VALID_ATTR) | (Attributes & EFI_FILE_DIRECTORY ? 0 : EFI_FILE_ARCHIVE);
+        c->parent = n;
+        __tmp_now(&c->ctime);
+        c->mtime = c->ctime;
+        *l = c;
+        n = c;
+    }
+    if((OpenMode & EFI_FILE_MODE_WRITE) && (n->attr & EFI_FILE_READ_ONLY)) return EFI_ACCESS_DENIED;
+    if(!(fh = (__tmpfh_t*)malloc(sizeof(__tmpfh_t)))) return EFI_OUT_OF_RESOURCES;
+    memset(fh, 0, sizeof(__tmpfh_t));
+    fh->p = __tmp_proto;
+    fh->node = n;
+    fh->mode = OpenMode;
+    n->refs++;
+    *NewHandle = &fh->p;
+    return EFI_SUCCESS;
+}
+
+/**
+ * Root directory of /tmp, never closed
+ */
+efi_file_handle_t *__tmpfs_root (void)
+{
+    if(!__tmp_rootfh.node) {
+        __tmp_root.name = L"";
+        __tmp_root.attr = EFI_FILE_DIRECTORY;
+        __tmp_rootfh.p = __tmp_proto;
+        __tmp_rootfh.node = &__tmp_root;
+        __tmp_rootfh.mode = EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE;
+    }
+    return &__tmp_rootfh.p;
+}
+
+/**
+ * Free everything, called on exit after all streams are closed
+ */
+void __tmpfs_cleanup (void)
+{
+    __tmpnode_t *n = __tmp_root.child, *p;
+    while(n) {
+        if(n->child) { n = n->child; continue; }
+        p = n->parent;
+        p->child = n->next;
+        __tmp_free(n);
+        n = p->child ? p->child : (p == &__tmp_root ? NULL : p);
+    }
+}
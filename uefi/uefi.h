@@ -62,6 +62,21 @@ extern char c_assert1[sizeof(uint32_t) == 4  ? 1 : -1];
 extern char c_assert2[sizeof(uint64_t) == 8  ? 1 : -1];
 extern char c_assert3[sizeof(uintptr_t) == 8 ? 1 : -1];
 
+/* printf conversions for the 64-bit types */
+#ifndef PRId64
+#ifndef __clang__
+#define __PRI64             "l"
+#else
+#define __PRI64             "ll"
+#endif
+#define PRId64              __PRI64 "d"
+#define PRIi64              __PRI64 "i"
+#define PRIu64              __PRI64 "u"
+#define PRIx64              __PRI64 "x"
+#define PRIX64              __PRI64 "X"
+#define PRIo64              __PRI64 "o"
+#endif
+
 #ifndef NULL
 #define NULL ((void*)0)
 #endif
@@ -71,6 +86,7 @@ typedef uint8_t  boolean_t;
 typedef uint16_t wchar_t;
 typedef uint64_t uintn_t;
 typedef uint64_t size_t;
+typedef int64_t  ssize_t;
 typedef uint64_t time_t;
 typedef uint64_t mode_t;
 typedef uint64_t off_t;
@@ -704,14 +720,14 @@ typedef void (EFIAPI *efi_event_notify_t)(efi_event_t Event, void *Context);
 typedef efi_status_t (EFIAPI *efi_create_event_t)(uint32_t Type, efi_tpl_t NotifyTpl, efi_event_notify_t NotifyFunction,
     void *NextContext, efi_event_t *Event);
 typedef efi_status_t (EFIAPI *efi_set_timer_t)(efi_event_t Event, efi_timer_delay_t Type, uint64_t TriggerTime);
-typedef efi_status_t (EFIAPI *efi_wait_for_event_t)(uintn_t NumberOfEvents, efi_event_t *Event, uintn_t Index);
+typedef efi_status_t (EFIAPI *efi_wait_for_event_t)(uintn_t NumberOfEvents, efi_event_t *Event, uintn_t *Index);
 typedef efi_status_t (EFIAPI *efi_signal_event_t)(efi_event_t Event);
 typedef efi_status_t (EFIAPI *efi_close_event_t)(efi_event_t Event);
 typedef efi_status_t (EFIAPI *efi_check_event_t)(efi_event_t Event);
 typedef efi_status_t (EFIAPI *efi_handle_protocol_t)(efi_handle_t Handle, efi_guid_t *Protocol, void **Interface);
 typedef efi_status_t (EFIAPI *efi_register_protocol_notify_t)(efi_guid_t *Protocol, efi_event_t Event, void **Registration);
 typedef efi_status_t (EFIAPI *efi_locate_handle_t)(efi_locate_search_type_t SearchType, efi_guid_t *Protocol,
-    void *SearchKey, uintn_t BufferSize, efi_handle_t *Buffer);
+    void *SearchKey, uintn_t *BufferSize, efi_handle_t *Buffer);
 typedef efi_status_t (EFIAPI *efi_locate_device_path_t)(efi_guid_t *Protocol, efi_device_path_t **DevicePath,
     efi_handle_t *Device);
 typedef efi_status_t (EFIAPI *efi_install_configuration_table_t)(efi_guid_t *Guid, void *Table);
@@ -738,7 +754,7 @@ typedef efi_status_t (EFIAPI *efi_open_protocol_information_t)(efi_handle_t Hand
 typedef efi_status_t (EFIAPI *efi_protocols_per_handle_t)(efi_handle_t Handle, efi_guid_t ***ProtocolBuffer,
     uintn_t *ProtocolBufferCount);
 typedef efi_status_t (EFIAPI *efi_locate_handle_buffer_t)(efi_locate_search_type_t SearchType, efi_guid_t *Protocol,
-    void *SearchKey, uintn_t NoHandles, efi_handle_t **Handles);
+    void *SearchKey, uintn_t *NoHandles, efi_handle_t **Handles);
 typedef efi_status_t (EFIAPI *efi_locate_protocol_t)(efi_guid_t *Protocol, void *Registration, void **Interface);
 typedef efi_status_t (EFIAPI *efi_calculate_crc32_t)(void *Data, uintn_t DataSize, uint32_t *Crc32);
 
@@ -878,6 +894,11 @@ extern efi_system_table_t *ST;
 #define EFI_FILE_HANDLE_REVISION           EFI_FILE_PROTOCOL_REVISION
 #endif
 
+#ifndef EFI_FILE_PROTOCOL_REVISION2
+#define EFI_FILE_PROTOCOL_REVISION2        0x00020000
+#define EFI_FILE_PROTOCOL_LATEST_REVISION  EFI_FILE_PROTOCOL_REVISION2
+#endif
+
 #ifndef EFI_FILE_INFO_GUID
 #define EFI_FILE_INFO_GUID  { 0x9576e92, 0x6d3f, 0x11d2, {0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
 #endif
@@ -919,6 +940,19 @@ typedef efi_status_t (EFIAPI *efi_file_set_info_t)(efi_file_handle_t *File, efi_
     void *Buffer);
 typedef efi_status_t (EFIAPI *efi_file_flush_t)(efi_file_handle_t *File);
 
+typedef struct {
+    efi_event_t             Event;
+    efi_status_t            Status;
+    uintn_t                 BufferSize;
+    void                    *Buffer;
+} efi_file_io_token_t;
+
+typedef efi_status_t (EFIAPI *efi_file_open_ex_t)(efi_file_handle_t *File, efi_file_handle_t **NewHandle, wchar_t *FileName,
+    uint64_t OpenMode, uint64_t Attributes, efi_file_io_token_t *Token);
+typedef efi_status_t (EFIAPI *efi_file_read_ex_t)(efi_file_handle_t *File, efi_file_io_token_t *Token);
+typedef efi_status_t (EFIAPI *efi_file_write_ex_t)(efi_file_handle_t *File, efi_file_io_token_t *Token);
+typedef efi_status_t (EFIAPI *efi_file_flush_ex_t)(efi_file_handle_t *File, efi_file_io_token_t *Token);
+
 struct efi_file_handle_s {
     uint64_t                Revision;
     efi_file_open_t         Open;
@@ -931,6 +965,11 @@ struct efi_file_handle_s {
     efi_file_get_info_t     GetInfo;
     efi_file_set_info_t     SetInfo;
     efi_file_flush_t        Flush;
+    /* only valid if Revision >= EFI_FILE_PROTOCOL_REVISION2 */
+    efi_file_open_ex_t      OpenEx;
+    efi_file_read_ex_t      ReadEx;
+    efi_file_write_ex_t     WriteEx;
+    efi_file_flush_ex_t     FlushEx;
 };
 
 /*** Shell Parameter Protocols ***/
@@ -1079,10 +1118,30 @@ typedef struct {
     efi_block_flush_t       FlushBlocks;
 } efi_block_io_t;
 
+/*** Block IO 2 Protocol ***/
+#ifndef EFI_BLOCK_IO2_PROTOCOL_GUID
+#define EFI_BLOCK_IO2_PROTOCOL_GUID { 0xa77b2472, 0xe282, 0x4e9f, {0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1} }
+#endif
+
 typedef struct {
-    off_t                   offset;
-    efi_block_io_t          *bio;
-} block_file_t;
+    efi_event_t             Event;
+    efi_status_t            TransactionStatus;
+} efi_block_io2_token_t;
+
+typedef efi_status_t (EFIAPI *efi_block_reset_ex_t)(void *This, boolean_t ExtendedVerification);
+typedef efi_status_t (EFIAPI *efi_block_read_ex_t)(void *This, uint32_t MediaId, efi_lba_t LBA,
+    efi_block_io2_token_t *Token, uintn_t BufferSize, void *Buffer);
+typedef efi_status_t (EFIAPI *efi_block_write_ex_t)(void *This, uint32_t MediaId, efi_lba_t LBA,
+    efi_block_io2_token_t *Token, uintn_t BufferSize, void *Buffer);
+typedef efi_status_t (EFIAPI *efi_block_flush_ex_t)(void *This, efi_block_io2_token_t *Token);
+
+typedef struct {
+    efi_block_io_media_t    *Media;
+    efi_block_reset_ex_t    Reset;
+    efi_block_read_ex_t     ReadBlocksEx;
+    efi_block_write_ex_t    WriteBlocksEx;
+    efi_block_flush_ex_t    FlushBlocksEx;
+} efi_block_io2_t;
 
 /*** Graphics Output Protocol (not used, but could be useful to have) ***/
 #ifndef EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID
@@ -1240,9 +1299,12 @@ struct dirent {
     unsigned char d_type;
     char_t d_name[FILENAME_MAX];
 };
-typedef struct efi_file_handle_s DIR;
+typedef struct __file_s DIR;
 extern DIR *opendir (const char_t *__name);
 extern struct dirent *readdir (DIR *__dirp);
+extern int readdir_r (DIR *__dirp, struct dirent *__entry, struct dirent **__result);
+extern long telldir (DIR *__dirp);
+extern void seekdir (DIR *__dirp, long __pos);
 extern void rewinddir (DIR *__dirp);
 extern int closedir (DIR *__dirp);
 
@@ -1282,6 +1344,10 @@ extern int errno;
 #define	EPIPE		32	/* Broken pipe */
 #define	EDOM		33	/* Math argument out of domain of func */
 #define	ERANGE		34	/* Math result not representable */
+#define	ENAMETOOLONG	36	/* File name too long */
+#define	ENOTEMPTY	39	/* Directory not empty */
+#define	ETIMEDOUT	110	/* Connection timed out */
+#define	EINPROGRESS	115	/* Operation now in progress */
 
 /* stdlib.h */
 #define RAND_MAX       2147483647
@@ -1308,39 +1374,124 @@ extern void srand(unsigned int __seed);
 extern int rand(void);
 extern uint8_t *getenv(char_t *name, uintn_t *len);
 extern int setenv(char_t *name, uintn_t len, uint8_t *data);
+/* non-standard, decompress LZ4 frames into a buffer. Returns the decompressed size, or -1 */
+extern ssize_t lz4_decompress (const void *__src, size_t __srclen, void *__dst, size_t __dstlen);
+/* non-standard, uncompressed size from the LZ4 frame header, 0 if it isn't stored */
+extern size_t lz4_size (const void *__src, size_t __srclen);
+/* non-standard, a file embedded from RESDIR at build time, NULL if there's no such file */
+extern const void *resource_get (const char_t *__name, size_t *__size);
 
 /* stdio.h */
+/* let the compiler check printf arguments. Only possible with UTF-8 format strings, and the compiler doesn't know about
+ * the non-standard %D and %q conversions, so define UEFI_NO_FORMAT_CHECK before including uefi.h if you use those */
+#if USE_UTF8 && defined(__GNUC__) && !defined(UEFI_NO_FORMAT_CHECK)
+#define __PRINTF(f, a)      __attribute__((format(printf, f, a)))
+#else
+#define __PRINTF(f, a)
+#endif
 #ifndef BUFSIZ
 #define BUFSIZ 8192
 #endif
 #define SEEK_SET	0	/* Seek from beginning of file.  */
 #define SEEK_CUR	1	/* Seek from current position.  */
 #define SEEK_END	2	/* Seek from end of file.  */
-#define stdin (FILE*)ST->ConsoleInHandle
-#define stdout (FILE*)ST->ConsoleOutHandle
-#define stderr (FILE*)ST->ConsoleErrorHandle
-typedef struct efi_file_handle_s FILE;
+#define _IOFBF		0	/* Fully buffered.  */
+#define _IOLBF		1	/* Line buffered.  */
+#define _IONBF		2	/* No buffering.  */
+#define EOF (-1)
+#ifndef FOPEN_MAX
+#define FOPEN_MAX 32
+#endif
+struct stat;
+typedef struct __file_s FILE;
+/* stream operations, one table per stream type */
+typedef struct {
+    size_t (*read)(FILE *__stream, void *__ptr, size_t __n);
+    size_t (*write)(FILE *__stream, const void *__ptr, size_t __n);
+    int (*seek)(FILE *__stream, int64_t __off, int __whence);
+    off_t (*tell)(FILE *__stream);
+    int (*eof)(FILE *__stream);
+    int (*flush)(FILE *__stream);
+    int (*close)(FILE *__stream);
+    int (*stat)(FILE *__stream, struct stat *__buf);
+} __file_ops_t;
+#define __FT_CON    1   /* console, stdin / stdout / stderr */
+#define __FT_SER    2   /* /dev/serial */
+#define __FT_BLK    3   /* /dev/disk */
+#define __FT_FILE   4   /* file or directory on a Simple File System */
+#define __FT_MEM    5   /* fmemopen */
+#define __FT_GZ     6   /* decompressing stream, fopen "rz", .gz or .lz4 */
+#define __FF_RDONLY     1
+#define __FF_FREEBUF    2
+#define __FF_STALE      4   /* cached offset and size must be queried from the firmware */
+#define __FF_LBF        8   /* line buffered */
+#define __FF_NBF        16  /* unbuffered */
+#define __FF_CR         32  /* last flushed character was a carriage return */
+#define __FF_NONBLOCK   64  /* serial reads return only what's already received */
+#define __FF_MOVED      128 /* the firmware's file position isn't the stream's, set it before the next transfer */
+struct __file_s {
+    const __file_ops_t *ops;
+    int type;                       /* zero if the slot is free */
+    int flags;
+    union {
+        void *ptr;
+        efi_file_handle_t *fh;
+        efi_serial_io_protocol_t *ser;
+        efi_block_io_t *bio;
+        uint8_t *mem;
+    } h;
+    off_t offset;                   /* current position */
+    off_t size;                     /* cached size for files and memory streams */
+    void *buf;                      /* output buffer, UTF-16 for the console, receive ring for serial, records for directories */
+    size_t bufsiz;                  /* in characters, bytes for serial */
+    size_t buflen;
+};
+extern FILE __stdio_files[];
+#define stdin (&__stdio_files[0])
+#define stdout (&__stdio_files[1])
+#define stderr (&__stdio_files[2])
 extern int fclose (FILE *__stream);
 extern int fflush (FILE *__stream);
+extern int setvbuf (FILE *__stream, char *__buf, int __modes, size_t __n);
+extern void setbuf (FILE *__stream, char *__buf);
+/* non-standard, copy stdout and stderr to the serial port, and keep the last output in a ring buffer */
+extern int stdio_tee (char *__buf, size_t __size);
+extern size_t stdio_tee_log (char *__buf, size_t __n);
+/* non-standard, serial port settings, also accepted in the name like "/dev/serial115200,fifo=64,timeout=500,nonblock" */
+#define SER_BAUD        1   /* bits per second */
+#define SER_FIFO        2   /* receive FIFO depth, 0 is the firmware's default */
+#define SER_TIMEOUT     3   /* per character timeout in microseconds, 0 is the firmware's default */
+#define SER_NONBLOCK    4   /* 1 if reads should return only what's already received */
+extern int serctl (FILE *__stream, int __req, uintn_t __val);
 extern int remove (const char_t *__filename);
 extern FILE *fopen (const char_t *__filename, const char_t *__modes);
+/* non-standard, like fopen, but relative paths start at a directory opened with opendir */
+extern FILE *fopenat (DIR *__dirp, const char_t *__filename, const char_t *__modes);
+extern FILE *fmemopen (void *__s, size_t __len, const char_t *__modes);
+/* non-standard, read a tar or cpio archive into memory, and serve its members under prefix */
+extern int archive_mount (const char_t *__archive, const char_t *__prefix);
+extern int archive_umount (const char_t *__prefix);
 extern size_t fread (void *__ptr, size_t __size, size_t __n, FILE *__stream);
 extern size_t fwrite (const void *__ptr, size_t __size, size_t __n, FILE *__s);
 extern int fseek (FILE *__stream, long int __off, int __whence);
 extern long int ftell (FILE *__stream);
+extern int fseeko (FILE *__stream, off_t __off, int __whence);
+extern off_t ftello (FILE *__stream);
 extern int feof (FILE *__stream);
-extern int fprintf (FILE *__stream, const char_t *__format, ...);
-extern int printf (const char_t *__format, ...);
-extern int sprintf (char_t *__s, const char_t *__format, ...);
-extern int vfprintf (FILE *__s, const char_t *__format, __builtin_va_list __arg);
-extern int vprintf (const char_t *__format, __builtin_va_list __arg);
-extern int vsprintf (char_t *__s, const char_t *__format, __builtin_va_list __arg);
-extern int snprintf (char_t *__s, size_t __maxlen, const char_t *__format, ...);
-extern int vsnprintf (char_t *__s, size_t __maxlen, const char_t *__format, __builtin_va_list __arg);
+extern int fprintf (FILE *__stream, const char_t *__format, ...) __PRINTF(2, 3);
+extern int printf (const char_t *__format, ...) __PRINTF(1, 2);
+extern int sprintf (char_t *__s, const char_t *__format, ...) __PRINTF(2, 3);
+extern int vfprintf (FILE *__s, const char_t *__format, __builtin_va_list __arg) __PRINTF(2, 0);
+extern int vprintf (const char_t *__format, __builtin_va_list __arg) __PRINTF(1, 0);
+extern int vsprintf (char_t *__s, const char_t *__format, __builtin_va_list __arg) __PRINTF(2, 0);
+extern int snprintf (char_t *__s, size_t __maxlen, const char_t *__format, ...) __PRINTF(3, 4);
+extern int vsnprintf (char_t *__s, size_t __maxlen, const char_t *__format, __builtin_va_list __arg) __PRINTF(3, 0);
 extern int getchar (void);
 /* non-blocking, only returns UNICODE if there's any key pressed, 0 otherwise */
 extern int getchar_ifany (void);
 extern int putchar (int __c);
+extern int fputs (const char_t *__s, FILE *__stream);
+extern int puts (const char_t *__s);
 
 /* string.h */
 extern void *memcpy(void *__dest, const void *__src, size_t __n);
@@ -1390,8 +1541,36 @@ struct stat {
 };
 extern int stat (const char_t *__file, struct stat *__buf);
 extern int fstat (FILE *__f, struct stat *__buf);
+/* non-standard, dirent.h functions that return the stat data from the directory record */
+extern struct dirent *readdir_plus (DIR *__dirp, struct stat *__buf);
+extern int fstatat (DIR *__dirp, const char_t *__name, struct stat *__buf, int __flag);
 extern int mkdir (const char_t *__path, mode_t __mode);
 
+/* ftw.h */
+#define FTW_F       0   /* regular file */
+#define FTW_D       1   /* directory, before its contents */
+#define FTW_DNR     2   /* directory that can't be read */
+#define FTW_NS      3   /* stat failed */
+#define FTW_SL      4
+#define FTW_DP      5   /* directory, after its contents */
+#define FTW_SLN     6
+#define FTW_PHYS    1
+#define FTW_MOUNT   2
+#define FTW_CHDIR   4
+#define FTW_DEPTH   8   /* post-order, report directories after their contents */
+#define FTW_ACTIONRETVAL 16 /* callback returns one of the FTW_CONTINUE ... values below */
+#define FTW_PREPOST 32  /* non-standard, report directories both before and after their contents */
+#define FTW_CONTINUE        0
+#define FTW_STOP            1
+#define FTW_SKIP_SUBTREE    2
+#define FTW_SKIP_SIBLINGS   3
+struct FTW {
+    int base;           /* offset of the file name in the path */
+    int level;          /* depth relative to the starting directory */
+};
+typedef int (*__nftw_func_t) (const char_t *__fpath, const struct stat *__sb, int __typeflag, struct FTW *__ftwbuf);
+extern int nftw (const char_t *__dir, __nftw_func_t __fn, int __nopenfd, int __flags);
+
 /* time.h */
 struct tm {
   int tm_sec;   /* Seconds. [0-60] (1 leap second) */
@@ -1407,11 +1586,48 @@ struct tm {
 extern struct tm *localtime (const time_t *__timer);
 extern time_t mktime(const struct tm *__tm);
 extern time_t time(time_t *__timer);
+struct timespec {
+    time_t tv_sec;
+    long int tv_nsec;
+};
 
 /* unistd.h */
 extern unsigned int sleep (unsigned int __seconds);
 extern int usleep (unsigned long int __useconds);
 extern int unlink (const wchar_t *__filename);
+/* FILE* instead of fd, the stream's position doesn't change */
+extern ssize_t pread (FILE *__stream, void *__buf, size_t __n, off_t __off);
+extern ssize_t pwrite (FILE *__stream, const void *__buf, size_t __n, off_t __off);
+
+/* sys/uio.h */
+#define IOV_MAX 1024
+struct iovec {
+    void    *iov_base;
+    size_t  iov_len;
+};
+/* FILE* instead of fd */
+extern ssize_t readv (FILE *__stream, const struct iovec *__iov, int __iovcnt);
+extern ssize_t writev (FILE *__stream, const struct iovec *__iov, int __iovcnt);
+
+/* aio.h */
+#define AIO_LISTIO_MAX  64
+struct aiocb {
+    FILE                *aio_fildes;
+    off_t               aio_offset;
+    volatile void       *aio_buf;
+    size_t              aio_nbytes;
+    efi_event_t         aio_event;  /* signaled on completion, created by aio_read / aio_write if NULL */
+    efi_file_io_token_t __token;
+    int                 __flags;
+};
+extern int aio_read (struct aiocb *__aiocbp);
+extern int aio_write (struct aiocb *__aiocbp);
+extern int aio_error (const struct aiocb *__aiocbp);
+extern ssize_t aio_return (struct aiocb *__aiocbp);
+extern int aio_suspend (const struct aiocb *const __list[], int __nent, const struct timespec *__timeout);
+/* non-standard, copy between any two streams (files, disks, serial, memory), FILE* instead of fds */
+extern ssize_t copy_file_range (FILE *__in, off_t *__off_in, FILE *__out, off_t *__off_out, size_t __len, unsigned int __flags);
+extern ssize_t sendfile (FILE *__out, FILE *__in, off_t *__offset, size_t __count);
 
 #ifdef  __cplusplus
 }